@@ -0,0 +1,195 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// measures how fast bdecode_context decodes DHT sized messages and a
+// metadata (info dictionary) sized one. Malformed inputs are first checked to
+// be rejected with the expected error.
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bdecode.hpp"
+
+using namespace libtorrent;
+
+namespace {
+
+std::string str(std::string const& s)
+{
+	return std::to_string(s.size()) + ":" + s;
+}
+
+std::string bytes(std::size_t const n, unsigned seed)
+{
+	std::string ret(n, '\0');
+	for (auto& c : ret) {
+		seed = seed * 1103515245 + 12345;
+		c = char(seed >> 16);
+	}
+	return ret;
+}
+
+// a get_peers response with 8 nodes, a ping and an announce_peer query
+std::vector<std::string> make_dht_messages()
+{
+	std::vector<std::string> ret;
+	for (unsigned i = 0; i < 100; ++i) {
+		ret.push_back("d1:rd2:id20:" + bytes(20, i) + "5:nodes208:" + bytes(208, i + 1)
+			+ "5:token8:" + bytes(8, i + 2) + "e1:t2:aa1:v4:LT\x01\x02" "1:y1:re");
+		ret.push_back("d1:ad2:id20:" + bytes(20, i + 3) + "e1:q4:ping1:t2:" + bytes(2, i) + "1:y1:qe");
+		ret.push_back("d1:ad2:id20:" + bytes(20, i + 4) + "12:implied_porti1e9:info_hash20:"
+			+ bytes(20, i + 5) + "4:porti" + std::to_string(6881 + i) + "e5:token8:"
+			+ bytes(8, i + 6) + "e1:q13:announce_peer1:t2:" + bytes(2, i + 1) + "1:y1:qe");
+	}
+	return ret;
+}
+
+// an info dictionary of a multi-file torrent with 200 files and 2000 pieces
+std::string make_metadata()
+{
+	std::string files = "l";
+	for (int i = 0; i < 200; ++i) {
+		files += "d6:lengthi" + std::to_string(1048576 * (i + 1) + i * 977) + "e4:pathl"
+			+ str("dir" + std::to_string(i % 7)) + str("file-" + std::to_string(i) + ".dat") + "ee";
+	}
+	files += "e";
+	return "d5:files" + files + "4:name" + str("a torrent") + "12:piece lengthi262144e6:pieces"
+		+ str(bytes(2000 * 20, 42)) + "e";
+}
+
+double decode_rate(std::vector<std::string> const& msgs, int const rounds, std::size_t& sink)
+{
+	using clock = std::chrono::steady_clock;
+	bdecode_context ctx;
+	error_code ec;
+	auto const start = clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		for (auto const& m : msgs) {
+			bdecode_node const n = ctx.decode({m.data(), std::ptrdiff_t(m.size())}, ec);
+			sink += std::size_t(n.dict_size());
+		}
+	}
+	double const t = std::chrono::duration<double>(clock::now() - start).count();
+	return double(msgs.size()) * rounds / t;
+}
+
+bool check_error(std::string const& buf, error_code const expected)
+{
+	error_code ec;
+	bdecode(span<char const>(buf.data(), std::ptrdiff_t(buf.size())), ec);
+	if (ec == expected) return true;
+	std::cerr << "\"" << buf << "\": expected \"" << expected.message()
+		<< "\" got \"" << ec.message() << "\"\n";
+	return false;
+}
+
+// feeds "buf" to a bdecode_stream one byte at a time and returns the keys it
+// reports, truncated ones followed by "..."
+std::string stream_keys(std::string const& buf)
+{
+	using item = bdecode_stream::item;
+	bdecode_stream s;
+	std::string ret;
+	for (char const& c : buf) {
+		span<char const> in(&c, 1);
+		while (!in.empty()) {
+			item it;
+			in = in.subspan(s.next(in, it));
+			if (it.type != item::key_t) continue;
+			ret.append(it.key.data(), it.key.size());
+			ret += it.truncated ? "...," : ",";
+		}
+	}
+	return ret;
+}
+
+bool check_keys(std::string const& buf, std::string const& expected)
+{
+	std::string const keys = stream_keys(buf);
+	if (keys == expected) return true;
+	std::cerr << "\"" << buf << "\": expected keys \"" << expected
+		<< "\" got \"" << keys << "\"\n";
+	return false;
+}
+
+}
+
+int main()
+{
+	bool ok = true;
+	ok &= check_error("i12345678901234567890e", error_code());
+	ok &= check_error("i123456789012345678901e", bdecode_errors::overflow);
+	ok &= check_error("i12a3e", bdecode_errors::expected_digit);
+	ok &= check_error("ie", bdecode_errors::expected_digit);
+	ok &= check_error("i-e", bdecode_errors::expected_digit);
+	ok &= check_error("i1234567890", bdecode_errors::unexpected_eof);
+	ok &= check_error("100000000000000000000000000000000000:", bdecode_errors::overflow);
+	ok &= check_error("12345678", bdecode_errors::expected_colon);
+	ok &= check_error("12345678901234567890123456789012345678", bdecode_errors::overflow);
+	ok &= check_error("1234567890123456789x:", bdecode_errors::expected_digit);
+	ok &= check_error("99999:abc", bdecode_errors::unexpected_eof);
+	ok &= check_error("d3:abcl0000003:xyzee", error_code());
+	// keys longer than max_key are reported by their prefix
+	ok &= check_keys("d1:md11:ut_metadatai2e40:" + std::string(40, 'x') + "i3eee"
+		, "m,ut_metadata," + std::string(32, 'x') + "...,");
+	if (!ok) return 1;
+
+	std::vector<std::string> const dht = make_dht_messages();
+	std::vector<std::string> const metadata{make_metadata()};
+
+	error_code ec;
+	bdecode_node const info = bdecode({metadata[0].data(), std::ptrdiff_t(metadata[0].size())}, ec);
+	if (ec || info.dict_find_int_value("piece length") != 262144
+		|| info.dict_find_list("files").list_size() != 200
+		|| info.dict_find_string("pieces").string_length() != 40000) {
+		std::cerr << "failed to decode metadata: " << ec.message() << '\n';
+		return 1;
+	}
+
+	std::size_t dht_bytes = 0;
+	for (auto const& m : dht) dht_bytes += m.size();
+
+	std::size_t sink = 0;
+	double const dht_rate = decode_rate(dht, 20000, sink);
+	double const metadata_rate = decode_rate(metadata, 20000, sink);
+
+	std::cout << std::fixed << std::setprecision(0)
+		<< "DHT messages: " << dht_rate << " msgs/s ("
+		<< std::setprecision(1) << dht_rate * double(dht_bytes) / double(dht.size()) / 1e6 << " MB/s)\n"
+		<< std::setprecision(0)
+		<< "metadata (" << metadata[0].size() / 1024 << " kiB): " << metadata_rate << " msgs/s ("
+		<< std::setprecision(1) << metadata_rate * double(metadata[0].size()) / 1e6 << " MB/s)\n";
+	return sink == 0;
+}
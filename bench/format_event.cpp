@@ -0,0 +1,274 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+// measures how many event log lines per second format_event() renders,
+// compared to the iostream based formatting it replaced. The two are also
+// checked to produce identical output. Large BITFIELD messages are measured
+// separately, in each of the formats.
+
+#include <bitset>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bt_event.hpp"
+
+namespace {
+
+std::ostream& operator<<(std::ostream& os, timeval const& ts)
+{
+	return os << ts.tv_sec << '.' << std::setfill('0') << std::setw(3) << ts.tv_usec / 1000;
+}
+
+void print_hex(std::ostream& os, span<unsigned char const> bytes)
+{
+	os << std::hex;
+	for (auto const c : bytes) os << std::setw(2) << std::setfill('0') << int(c);
+	os << std::dec;
+}
+
+std::string printable(span<unsigned char const> bytes)
+{
+	std::string ret;
+	for (auto const c : bytes) ret += (c >= ' ' && c < 127) ? char(c) : '.';
+	return ret;
+}
+
+std::string msg_type_name(int const msg)
+{
+	text_buffer buf;
+	append_msg_type_name(buf, msg);
+	return std::string(buf.begin(), buf.end());
+}
+
+// the formatting as it was done before, through iostreams
+void format_event_iostream(std::ostream& os, event_record const& e, span<unsigned char const> blob)
+{
+	if (e.type == event_type::reorder_depth) {
+		os << e.dir << " (transport layer: max reorder depth: " << e.length << ")\n";
+		return;
+	}
+
+	os << e.dir << ' ' << to_timeval(e.timestamp) << ' ';
+
+	if (std::uint8_t(e.type) < 64) {
+		int const msg = int(e.type);
+		os << message_name(msg);
+		switch (msg) {
+			case 4: case 9: case 13: case 17: os << ' ' << e.piece; break;
+			case 5:
+				os << ' ';
+				for (auto const c : blob) os << std::bitset<8>(c);
+				break;
+			case 6: case 8: case 16: os << ' ' << e.piece << ' ' << e.offset << ' ' << e.length; break;
+			case 7: os << ' ' << e.piece << ' ' << e.offset; break;
+			default: break;
+		}
+		os << '\n';
+		return;
+	}
+
+	switch (e.type) {
+		case event_type::handshake: os << "HANDSHAKE"; break;
+		case event_type::reserved: os << "RESERVED "; print_hex(os, blob); break;
+		case event_type::info_hash: os << "INFO-HASH "; print_hex(os, blob); break;
+		case event_type::peer_id:
+			os << "PEER-ID ";
+			print_hex(os, blob);
+			os << " [" << printable(blob) << "]";
+			break;
+		case event_type::keep_alive: os << "KEEP-ALIVE"; break;
+		case event_type::message_too_large:
+			os << "ERROR: message too large! " << e.length << " (" << std::hex << e.length << ")" << std::dec;
+			break;
+		case event_type::invalid_size:
+			os << "ERROR: invalid " << message_name(int(e.piece)) << " message size: " << e.length;
+			break;
+		case event_type::unknown_message: os << "msg: " << msg_type_name(int(e.piece)); break;
+		case event_type::extension_handshake:
+			os << "EXTENSION-HANDSHAKE ";
+			os.write(reinterpret_cast<char const*>(blob.data()), blob.size());
+			break;
+		case event_type::extension_message:
+			os << "EXTENSION-MSG: ";
+			if (e.piece) os.write(reinterpret_cast<char const*>(blob.data()), blob.size());
+			else os << "?? (" << e.offset << ")";
+			break;
+		case event_type::payload: os << "  - payload: " << e.length << " (left: " << e.offset << ")"; break;
+		case event_type::ack: os << "ACK"; break;
+		case event_type::reset:
+		case event_type::fin:
+		case event_type::seqnr_mismatch:
+		case event_type::timeout:
+			os << socket_event_t(std::uint8_t(e.type) - std::uint8_t(event_type::reset));
+			break;
+		default: os << "?? (" << int(e.type) << ")"; break;
+	}
+	os << '\n';
+}
+
+struct event
+{
+	event_record record;
+	std::string blob;
+};
+
+event make_event(std::int64_t const ts, event_type const t, std::uint32_t const piece = 0
+	, std::uint32_t const offset = 0, std::uint32_t const length = 0, std::string blob = {})
+{
+	return event{event_record{0, ts, piece, offset, length, t, dir_t((ts / 7) & 1), 0}, std::move(blob)};
+}
+
+// a mix of events resembling a download: mostly blocks being requested and
+// received, with the occasional handshake and oddity
+std::vector<event> make_events()
+{
+	std::vector<event> ret;
+	std::int64_t ts = 1589732941000000;
+	std::string const hash = "\x8a\x1f\x00\x33\x9e\x5c\x47\xf0\x12\x34\x56\x78\x9a\xbc\xde\xf0\x01\x02\x03\x04";
+	std::string const peer_id = "-LT1220-\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c";
+	for (std::uint32_t i = 0; i < 1000; ++i) {
+		ts += 1234;
+		if (i % 100 == 0) {
+			ret.push_back(make_event(ts, event_type::handshake));
+			ret.push_back(make_event(ts, event_type::reserved, 0, 0, 8, std::string("\0\0\0\0\0\x10\0\x05", 8)));
+			ret.push_back(make_event(ts, event_type::info_hash, 0, 0, 20, hash));
+			ret.push_back(make_event(ts, event_type::peer_id, 0, 0, 20, peer_id));
+			ret.push_back(make_event(ts, event_type::extension_handshake, 0, 0, 0
+				, "{ 'm': { 'ut_metadata': 2, 'ut_pex': 1 }, 'v': 'libtorrent 1.2.20' }"));
+			ret.push_back(make_event(ts, event_type(5), 0, 0, 0, std::string(16, '\xf7')));
+			ret.push_back(make_event(ts, event_type::extension_message, 1, 1, 0, "ut_pex"));
+			ret.push_back(make_event(ts, event_type::extension_message, 0, 7));
+			ret.push_back(make_event(ts, event_type::message_too_large, 0, 0, 0x2000000));
+			ret.push_back(make_event(ts, event_type::unknown_message, 42));
+			ret.push_back(make_event(ts, event_type::invalid_size, 4, 0, 5));
+			ret.push_back(make_event(ts, event_type::keep_alive));
+			ret.push_back(make_event(ts, event_type::timeout));
+			ret.push_back(make_event(ts, event_type::reorder_depth, 0, 0, 12));
+		}
+		ret.push_back(make_event(ts, event_type(6), i / 16, i % 16 * 16384, 16384));
+		ret.push_back(make_event(ts, event_type(7), i / 16, i % 16 * 16384));
+		ret.push_back(make_event(ts, event_type::payload, 0, 16384 - 1400, 1400));
+		ret.push_back(make_event(ts, event_type::payload, 0, 0, 16384 - 1400));
+		ret.push_back(make_event(ts, event_type(4), i));
+		ret.push_back(make_event(ts, event_type::ack));
+	}
+	return ret;
+}
+
+span<unsigned char const> bytes(std::string const& s)
+{
+	return {reinterpret_cast<unsigned char const*>(s.data()), std::ptrdiff_t(s.size())};
+}
+
+}
+
+int main()
+{
+	auto const events = make_events();
+
+	// make sure both render the same thing
+	std::ostringstream expected;
+	text_buffer actual;
+	for (auto const& e : events) {
+		format_event_iostream(expected, e.record, bytes(e.blob));
+		format_event(actual, e.record, bytes(e.blob));
+	}
+	if (expected.str() != std::string(actual.begin(), actual.end())) {
+		std::cerr << "output mismatch!\n";
+		return 1;
+	}
+
+	int const rounds = 500;
+	using clock = std::chrono::steady_clock;
+	std::size_t sink = 0;
+
+	auto start = clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		std::ostringstream os;
+		for (auto const& e : events) format_event_iostream(os, e.record, bytes(e.blob));
+		sink += std::size_t(os.tellp());
+	}
+	double const iostream_time = std::chrono::duration<double>(clock::now() - start).count();
+
+	start = clock::now();
+	text_buffer buf;
+	for (int r = 0; r < rounds; ++r) {
+		buf.clear();
+		for (auto const& e : events) format_event(buf, e.record, bytes(e.blob));
+		sink += buf.size();
+	}
+	double const buffer_time = std::chrono::duration<double>(clock::now() - start).count();
+
+	double const lines = double(events.size()) * rounds;
+	std::cout << std::fixed << std::setprecision(0)
+		<< "iostream:    " << lines / iostream_time << " lines/s\n"
+		<< "text_buffer: " << lines / buffer_time << " lines/s\n"
+		<< std::setprecision(2) << "speed-up: " << iostream_time / buffer_time << "x\n";
+
+	// the BITFIELD of a peer that has most of a torrent with 100k pieces: the
+	// first 80% with a piece missing here and there
+	std::string bitfield(12500, '\0');
+	for (std::size_t i = 0; i < 10000; ++i) bitfield[i] = (i % 50 == 0) ? '\xfb' : '\xff';
+	event const bf = make_event(1589732941000000, event_type(5), 0, 0, 0, bitfield);
+	int const bf_rounds = 200;
+
+	start = clock::now();
+	for (int r = 0; r < bf_rounds; ++r) {
+		std::ostringstream os;
+		format_event_iostream(os, bf.record, bytes(bf.blob));
+		sink += std::size_t(os.tellp());
+	}
+	double const bf_iostream = std::chrono::duration<double>(clock::now() - start).count();
+
+	double bf_time[3];
+	for (int f = 0; f < 3; ++f) {
+		format_options const opts{bitfield_format(f)};
+		start = clock::now();
+		for (int r = 0; r < bf_rounds; ++r) {
+			buf.clear();
+			format_event(buf, bf.record, bytes(bf.blob), opts);
+			sink += buf.size();
+		}
+		bf_time[f] = std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+	std::cout << std::setprecision(0) << "\nBITFIELD of 100k pieces:\n"
+		<< "iostream:    " << bf_rounds / bf_iostream << " lines/s\n"
+		<< "full:        " << bf_rounds / bf_time[0] << " lines/s\n"
+		<< "summary:     " << bf_rounds / bf_time[1] << " lines/s\n"
+		<< "runs:        " << bf_rounds / bf_time[2] << " lines/s\n";
+	return sink == 0;
+}
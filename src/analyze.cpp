@@ -47,7 +47,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/asio/ip/address_v4.hpp>
 
 #include "utp_state.hpp"
-#include "pcap.hpp"
+#include "capture_reader.hpp"
 #include "str.hpp"
 #include "bittorrent.hpp"
 
@@ -59,16 +59,6 @@ template <typename Handler>
 struct processor
 {
 
-static void handler_wrapper(u_char *user_data, pcap_pkthdr const* pkthdr, u_char const* packet)
-{
-	auto* self = reinterpret_cast<processor<Handler>*>(user_data);
-	if (pkthdr->len != pkthdr->caplen) {
-		std::cout << " ERROR: missing data in capture! packet: " << pkthdr->len << " B captured: " << pkthdr->caplen << "B\n";
-	}
-	span<unsigned char const> pkt(packet, pkthdr->len);
-	self->process(pkthdr->ts, pkt);
-}
-
 void process(timeval const& ts, span<unsigned char const> pkt)
 {
 // TODO: ensure this is an ethernet frame, and maybe even support other physical links
@@ -76,6 +66,11 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 	if (!quiet_)
 		std::cout << "\x1b[0m";
 
+	if (pkt.size() < std::ptrdiff_t(sizeof(ether_header) + sizeof(ip))) {
+		if (!quiet_ && !connid_filter_)
+			std::cout << "[truncated]\n";
+		return;
+	}
 	auto const& eth_header = cast<ether_header const>(pkt);
 	pkt = pkt.subspan(sizeof(ether_header));
 
@@ -87,9 +82,6 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 	}
 
 	auto const& ip_header = cast<ip const>(pkt);
-	// read the header length to skip over IP option headers too
-	int const ip_header_len = int(ip_header.ip_hl) * 4;
-	pkt = pkt.subspan(ip_header_len, ntohs(ip_header.ip_len) - ip_header_len);
 
 	if (ip_header.ip_hl < 5) {
 		// invalid packet
@@ -98,6 +90,18 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 		return;
 	}
 
+	// read the header length to skip over IP option headers too. The
+	// capture's snaplen may have cut the record short, in which case we make
+	// do with what there is of it
+	int const ip_header_len = int(ip_header.ip_hl) * 4;
+	int const ip_len = std::min(int(ntohs(ip_header.ip_len)), int(pkt.size()));
+	if (ip_len < ip_header_len) {
+		if (!quiet_ && !connid_filter_)
+			std::cout << "[truncated]\n";
+		return;
+	}
+	pkt = pkt.subspan(ip_header_len, ip_len - ip_header_len);
+
 	// we only support IPv4
 	if (ip_header.ip_v != 4) {
 		if (!quiet_)
@@ -350,13 +354,8 @@ int main(int argc, char const* argv[]) try
 		--argc;
 	}
 
-	pcap_handle h = pcap_open(argv[0]);
-
-	// start packet processing loop, just like live capture
-	if (pcap_loop(h, 0, p.handler_wrapper, reinterpret_cast<unsigned char*>(&p)) < 0) {
-		std::cerr << "pcap_loop() failed: " << pcap_geterr(h);
-		return 1;
-	}
+	capture_stats const st = read_capture(argv[0]
+		, [&p](timeval const& ts, span<unsigned char const> pkt) { p.process(ts, pkt); });
 
 	if (!p.quiet_) {
 		std::cout << "\x1b[0m\n\n";
@@ -369,11 +368,13 @@ int main(int argc, char const* argv[]) try
 		}
 	}
 
+	std::cerr << st << '\n';
 	return 0;
 }
 catch (std::exception const& e)
 {
 	std::cerr << "failed: " << e.what() << '\n';
+	return 1;
 }
 
 
@@ -33,6 +33,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include <array>
+#include <cassert>
+#include <limits>
 #include <type_traits>
 
 template <typename T, typename IndexType, typename Base>
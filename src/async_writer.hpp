@@ -0,0 +1,454 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "spsc_queue.hpp"
+#include "str.hpp"
+
+// a bounded set of open files. Files are opened on demand, closing the least
+// recently used one when there's no room for another
+struct file_pool
+{
+	explicit file_pool(int const max_open) : m_max_open(std::max(1, max_open)) {}
+
+	file_pool(file_pool const&) = delete;
+	file_pool& operator=(file_pool const&) = delete;
+
+	~file_pool()
+	{
+		for (auto const& f : m_files) ::close(f.fd);
+	}
+
+	// returns a descriptor to write to file "id", or -1 and sets errno. The
+	// first time a file is opened, "create" should be set to create it (or
+	// truncate an existing one)
+	int open(std::uint32_t const id, std::string const& path, bool const create)
+	{
+		++m_clock;
+		for (auto& f : m_files) {
+			if (f.id != id) continue;
+			f.last_use = m_clock;
+			return f.fd;
+		}
+
+		if (int(m_files.size()) >= m_max_open) {
+			auto lru = std::min_element(m_files.begin(), m_files.end()
+				, [](entry const& lhs, entry const& rhs) { return lhs.last_use < rhs.last_use; });
+			::close(lru->fd);
+			m_files.erase(lru);
+		}
+
+		int const fd = ::open(path.c_str(), O_WRONLY | (create ? O_CREAT | O_TRUNC : 0), 0644);
+		if (fd < 0) return -1;
+		++m_opens;
+		m_files.push_back(entry{id, fd, m_clock});
+		return fd;
+	}
+
+	// returns the first error closing a file, if any
+	int close_all()
+	{
+		int error = 0;
+		for (auto const& f : m_files) {
+			if (::close(f.fd) != 0 && error == 0) error = errno;
+		}
+		m_files.clear();
+		return error;
+	}
+
+	// the number of times a file was opened
+	std::uint64_t opens() const { return m_opens; }
+
+private:
+
+	struct entry
+	{
+		std::uint32_t id;
+		int fd;
+		std::uint64_t last_use;
+	};
+
+	int const m_max_open;
+	std::uint64_t m_clock = 0;
+	std::uint64_t m_opens = 0;
+	std::vector<entry> m_files;
+};
+
+struct writer_stats
+{
+	std::uint64_t bytes = 0;
+	// the number of buffers handed to the writer
+	std::uint64_t buffers = 0;
+	// the number of pwritev() calls
+	std::uint64_t writes = 0;
+	// the number of times a file was (re-)opened
+	std::uint64_t opens = 0;
+
+	// the high-water marks of the number of buffers queued by a single thread,
+	// and of the bytes queued in total
+	std::uint64_t max_queue_depth = 0;
+	std::uint64_t max_queued_bytes = 0;
+
+	// the time threads producing logs were blocked on the queue being full,
+	// and the time the writer thread spent in pwritev()
+	double backpressure_seconds = 0;
+	double io_seconds = 0;
+
+	friend std::ostream& operator<<(std::ostream& os, writer_stats const& st)
+	{
+		return os << "wrote " << st.bytes << " B of logs from " << st.buffers
+			<< " buffers in " << st.writes << " writes (" << st.opens << " file opens)"
+			<< ", peak queue: " << st.max_queue_depth << " buffers, "
+			<< st.max_queued_bytes << " B, blocked on full queue: "
+			<< st.backpressure_seconds << " s, waiting for I/O: " << st.io_seconds << " s";
+	}
+};
+
+// writes buffers to files on a dedicated thread, to keep the threads producing
+// them from stalling on a slow disk. Every producing thread hands its buffers
+// to the writer over its own lock-free queue, so the buffers of a thread are
+// written in the order they were queued. Buffers queued back-to-back for
+// consecutive ranges of the same file are written with a single pwritev().
+//
+// The buffer passed to write() is swapped with one the writer is done with, so
+// a producer alternates between filling a buffer and having it written,
+// without allocating new ones.
+struct async_writer
+{
+	// "offset" to append to the file
+	static constexpr std::uint64_t append = ~std::uint64_t(0);
+
+	// at most "max_queued" bytes may be waiting to be written. When there's
+	// more, write() blocks until the writer has caught up
+	explicit async_writer(std::size_t const max_queued = 64 * 1024 * 1024
+		, int const max_open_files = 64)
+		: m_max_queued(max_queued)
+		, m_files(max_open_files)
+		, m_thread([this] { run(); })
+	{}
+
+	async_writer(async_writer const&) = delete;
+	async_writer& operator=(async_writer const&) = delete;
+
+	~async_writer()
+	{
+		try { close(); } catch (std::exception const&) {}
+	}
+
+	// returns the ID to write to "path" with. The file is created (or
+	// truncated) by the first write to it. If "check" is set, it's also created
+	// right away, to throw here if it can't be, rather than fail once the
+	// writer thread gets to it
+	std::uint32_t add_file(std::string path, bool const check = false)
+	{
+		if (check) {
+			int const fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				throw std::runtime_error(str("failed to open \"", path, "\": ", std::strerror(errno)));
+			::close(fd);
+		}
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_paths.push_back(file_entry{std::move(path), 0, false});
+		return std::uint32_t(m_paths.size() - 1);
+	}
+
+	// queues "buf" to be written to "file" at "offset" (or at its end, if
+	// "offset" is append). An empty buffer just creates the file. "buf" is
+	// swapped with an empty buffer
+	void write(std::uint32_t const file, std::uint64_t const offset, std::vector<char>& buf)
+	{
+		producer& p = local_producer();
+		std::uint64_t const size = buf.size();
+		request* r = p.queue.back();
+		if (r == nullptr || !room_for(size)) {
+			auto const start = std::chrono::steady_clock::now();
+			while ((r = p.queue.back()) == nullptr || !room_for(size))
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			m_backpressure_ns.fetch_add(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+		}
+		r->file = file;
+		r->offset = offset;
+		r->buf.swap(buf);
+		buf.clear();
+		update_max(m_max_queued_bytes, m_queued_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+		p.queue.push();
+		update_max(m_max_queue_depth, p.queue.size());
+	}
+
+	// waits for all queued buffers to be written and closes the files. Nothing
+	// may be written once this has been called. Throws if any write failed
+	void close()
+	{
+		if (!m_thread.joinable()) return;
+		m_done.store(true, std::memory_order_release);
+		m_thread.join();
+		if (m_error != 0)
+			throw std::runtime_error(str("failed to write \"", m_error_path, "\": ", std::strerror(m_error)));
+	}
+
+	// only valid once the writer is closed
+	writer_stats stats() const
+	{
+		writer_stats ret = m_stats;
+		ret.opens = m_files.opens();
+		ret.max_queue_depth = m_max_queue_depth.load(std::memory_order_relaxed);
+		ret.max_queued_bytes = m_max_queued_bytes.load(std::memory_order_relaxed);
+		ret.backpressure_seconds = double(m_backpressure_ns.load(std::memory_order_relaxed)) / 1e9;
+		return ret;
+	}
+
+private:
+
+	struct request
+	{
+		std::uint32_t file;
+		std::uint64_t offset;
+		std::vector<char> buf;
+	};
+
+	struct producer
+	{
+		spsc_queue<request> queue{256};
+	};
+
+	struct file_entry
+	{
+		std::string path;
+		// the members below are only touched by the writer thread
+		std::uint64_t size;
+		bool created;
+	};
+
+	bool room_for(std::uint64_t const size) const
+	{
+		// a buffer larger than the limit is let through once the queue has
+		// drained
+		std::uint64_t const queued = m_queued_bytes.load(std::memory_order_acquire);
+		return queued == 0 || queued + size <= m_max_queued;
+	}
+
+	static void update_max(std::atomic<std::uint64_t>& v, std::uint64_t const val)
+	{
+		std::uint64_t cur = v.load(std::memory_order_relaxed);
+		while (cur < val && !v.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {}
+	}
+
+	// the queue of the calling thread, created the first time a thread writes
+	producer& local_producer()
+	{
+		struct cache
+		{
+			std::uint64_t instance = 0;
+			producer* p = nullptr;
+		};
+		thread_local cache c;
+		if (c.instance == m_instance) return *c.p;
+
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_producers.emplace_back(new producer);
+		m_num_producers.store(m_producers.size(), std::memory_order_release);
+		c.instance = m_instance;
+		c.p = m_producers.back().get();
+		return *c.p;
+	}
+
+	void run()
+	{
+		std::vector<producer*> producers;
+		int idle = 0;
+		for (;;) {
+			// everything queued before close() was called is visible once we
+			// see m_done. Only stop once we've looked at every queue after that
+			bool const done = m_done.load(std::memory_order_acquire);
+			if (producers.size() != m_num_producers.load(std::memory_order_acquire)) {
+				std::lock_guard<std::mutex> l(m_mutex);
+				producers.clear();
+				for (auto const& p : m_producers) producers.push_back(p.get());
+			}
+
+			bool work = false;
+			for (auto* p : producers) {
+				while (write_batch(p->queue)) work = true;
+			}
+			if (work) {
+				idle = 0;
+				continue;
+			}
+			if (done) break;
+			if (++idle < 64) std::this_thread::yield();
+			else std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		int const error = m_files.close_all();
+		if (error != 0) fail(error, "log files");
+	}
+
+	// writes the buffer at the front of "q", along with any following it that
+	// extend it. Returns false if the queue is empty
+	bool write_batch(spsc_queue<request>& q)
+	{
+		request* r = q.peek(0);
+		if (r == nullptr) return false;
+
+		file_entry* f;
+		{
+			std::lock_guard<std::mutex> l(m_mutex);
+			f = &m_paths[r->file];
+		}
+
+		std::uint64_t const offset = r->offset == append ? f->size : r->offset;
+		std::uint64_t end = offset;
+		std::array<iovec, 64> iov;
+		std::size_t n = 0;
+		for (request* i = r; i != nullptr && n < iov.size(); i = q.peek(n)) {
+			if (i->file != r->file) break;
+			if (n > 0 && i->offset != append && i->offset != end) break;
+			iov[n++] = iovec{i->buf.data(), i->buf.size()};
+			end += i->buf.size();
+		}
+
+		if (m_error == 0) {
+			int const fd = m_files.open(r->file, f->path, !f->created);
+			if (fd < 0) {
+				fail(errno, f->path);
+			}
+			else {
+				f->created = true;
+				f->size = std::max(f->size, end);
+				if (end > offset) {
+					auto const start = std::chrono::steady_clock::now();
+					int const ret = pwritev_all(fd, iov.data(), int(n), offset);
+					m_stats.io_seconds += std::chrono::duration<double>(
+						std::chrono::steady_clock::now() - start).count();
+					if (ret != 0) fail(ret, f->path);
+				}
+			}
+		}
+
+		m_stats.bytes += end - offset;
+		m_stats.buffers += n;
+		for (std::size_t i = 0; i < n; ++i) {
+			request* done = q.peek(0);
+			m_queued_bytes.fetch_sub(done->buf.size(), std::memory_order_release);
+			done->buf.clear();
+			q.pop();
+		}
+		return true;
+	}
+
+	int pwritev_all(int const fd, iovec* iov, int n, std::uint64_t offset)
+	{
+		while (n > 0) {
+			// skip empty buffers, the kernel may not like a zero length iovec
+			// at the end
+			if (iov->iov_len == 0) {
+				++iov;
+				--n;
+				continue;
+			}
+			++m_stats.writes;
+			ssize_t ret = ::pwritev(fd, iov, n, off_t(offset));
+			if (ret < 0) {
+				if (errno == EINTR) continue;
+				return errno;
+			}
+			offset += std::uint64_t(ret);
+			// partial write, skip past what was written
+			while (n > 0 && ret >= ssize_t(iov->iov_len)) {
+				ret -= ssize_t(iov->iov_len);
+				++iov;
+				--n;
+			}
+			if (n > 0) {
+				iov->iov_base = static_cast<char*>(iov->iov_base) + ret;
+				iov->iov_len -= std::size_t(ret);
+			}
+		}
+		return 0;
+	}
+
+	void fail(int const error, std::string const& path)
+	{
+		if (m_error != 0) return;
+		m_error = error;
+		m_error_path = path;
+	}
+
+	// every writer gets a unique ID, for threads to tell whether the queue
+	// they have cached belongs to this writer
+	inline static std::atomic<std::uint64_t> next_instance{1};
+	std::uint64_t const m_instance = next_instance.fetch_add(1);
+
+	std::size_t const m_max_queued;
+	std::atomic<std::uint64_t> m_queued_bytes{0};
+	std::atomic<std::uint64_t> m_max_queued_bytes{0};
+	std::atomic<std::uint64_t> m_max_queue_depth{0};
+	std::atomic<std::uint64_t> m_backpressure_ns{0};
+	std::atomic<bool> m_done{false};
+
+	// protects m_paths and m_producers
+	std::mutex m_mutex;
+	// the elements of a deque don't move as it grows, so the writer thread
+	// may hold on to references to them without holding the mutex
+	std::deque<file_entry> m_paths;
+	std::vector<std::unique_ptr<producer>> m_producers;
+	std::atomic<std::size_t> m_num_producers{0};
+
+	// only used by the writer thread (and by stats() once it's done)
+	file_pool m_files;
+	writer_stats m_stats;
+	int m_error = 0;
+	std::string m_error_path;
+
+	// started last, once everything it uses has been constructed
+	std::thread m_thread;
+};
@@ -33,6 +33,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "bdecode.hpp"
 #include <boost/system/error_code.hpp>
 #include <limits>
+#include <algorithm>
 #include <cstring> // for memset
 #include <cstdio> // for snprintf
 #include <cinttypes> // for PRId64 et.al.
@@ -101,10 +102,14 @@ namespace {
 
 	struct stack_frame
 	{
-		stack_frame() : token(0), state(0) {}
-		explicit stack_frame(int const t): token(std::uint32_t(t)), state(0) {}
+		stack_frame() : token(0), dict(0), state(0) {}
+		stack_frame(int const t, bool const d)
+			: token(std::uint32_t(t)), dict(d), state(0) {}
 		// this is an index into m_tokens
-		std::uint32_t token:31;
+		std::uint32_t token:30;
+		// set if this is a dictionary. This saves looking up the token's type
+		// for every item in the container
+		std::uint32_t dict:1;
 		// this is used for dictionaries to indicate whether we're
 		// reading a key or a vale. 0 means key 1 is value
 		std::uint32_t state:1;
@@ -746,17 +751,18 @@ namespace detail {
 	goto done; \
 	} while(0)
 
-	bdecode_node bdecode(span<char const> buffer
+namespace detail {
+
+	int bdecode_tokens(std::vector<bdecode_token>& tokens, span<char const> buffer
 		, error_code& ec, int* error_pos, int token_limit)
 	{
-		bdecode_node ret;
 		ec.clear();
 
 		if (buffer.size() > bdecode_token::max_offset)
 		{
 			if (error_pos) *error_pos = 0;
 			ec = bdecode_errors::limit_exceeded;
-			return ret;
+			return -1;
 		}
 
 		// this is the stack of bdecode_token indices, into m_tokens.
@@ -787,38 +793,37 @@ namespace detail {
 			// look for a new token
 			char const t = *start;
 
-			int const current_frame = sp;
+			// the dictionary we're parsing an item of, if any. An item that
+			// terminates it still counts as one of its items
+			stack_frame* const parent_dict
+				= (sp > 0 && stack[sp - 1].dict) ? &stack[sp - 1] : nullptr;
 
 			// if we're currently parsing a dictionary, assert that
 			// every other node is a string.
-			if (current_frame > 0
-				&& ret.m_tokens[stack[current_frame - 1].token].type == bdecode_token::dict)
+			if (parent_dict && parent_dict->state == 0)
 			{
-				if (stack[current_frame - 1].state == 0)
-				{
-					// the current parent is a dict and we are parsing a key.
-					// only allow a digit (for a string) or 'e' to terminate
-					if (!numeric(t) && t != 'e')
-						TORRENT_FAIL_BDECODE(bdecode_errors::expected_digit);
-				}
+				// the current parent is a dict and we are parsing a key.
+				// only allow a digit (for a string) or 'e' to terminate
+				if (!numeric(t) && t != 'e')
+					TORRENT_FAIL_BDECODE(bdecode_errors::expected_digit);
 			}
 
 			switch (t)
 			{
 				case 'd':
-					stack[sp++] = stack_frame(int(ret.m_tokens.size()));
+					stack[sp++] = stack_frame(int(tokens.size()), true);
 					// we push it into the stack so that we know where to fill
 					// in the next_node field once we pop this node off the stack.
 					// i.e. get to the node following the dictionary in the buffer
-					ret.m_tokens.push_back({start - orig_start, bdecode_token::dict});
+					tokens.push_back({start - orig_start, bdecode_token::dict});
 					++start;
 					break;
 				case 'l':
-					stack[sp++] = stack_frame(int(ret.m_tokens.size()));
+					stack[sp++] = stack_frame(int(tokens.size()), false);
 					// we push it into the stack so that we know where to fill
 					// in the next_node field once we pop this node off the stack.
 					// i.e. get to the node following the list in the buffer
-					ret.m_tokens.push_back({start - orig_start, bdecode_token::list});
+					tokens.push_back({start - orig_start, bdecode_token::list});
 					++start;
 					break;
 				case 'i':
@@ -836,7 +841,7 @@ namespace detail {
 						start = int_start;
 						TORRENT_FAIL_BDECODE(e);
 					}
-					ret.m_tokens.push_back({int_start - orig_start
+					tokens.push_back({int_start - orig_start
 						, 1, bdecode_token::integer, 1});
 					assert(*start == 'e');
 
@@ -850,9 +855,7 @@ namespace detail {
 					if (sp == 0)
 						TORRENT_FAIL_BDECODE(bdecode_errors::unexpected_eof);
 
-					if (sp > 0
-						&& ret.m_tokens[stack[sp - 1].token].type == bdecode_token::dict
-						&& stack[sp - 1].state == 1)
+					if (parent_dict && parent_dict->state == 1)
 					{
 						// this means we're parsing a dictionary and about to parse a
 						// value associated with a key. Instead, we got a termination
@@ -860,17 +863,17 @@ namespace detail {
 					}
 
 					// insert the end-of-sequence token
-					ret.m_tokens.push_back({start - orig_start, 1, bdecode_token::end});
+					tokens.push_back({start - orig_start, 1, bdecode_token::end});
 
 					// and back-patch the start of this sequence with the offset
 					// to the next token we'll insert
 					int const top = stack[sp - 1].token;
 					// subtract the token's own index, since this is a relative
 					// offset
-					if (int(ret.m_tokens.size()) - top > bdecode_token::max_next_item)
+					if (int(tokens.size()) - top > bdecode_token::max_next_item)
 						TORRENT_FAIL_BDECODE(bdecode_errors::limit_exceeded);
 
-					ret.m_tokens[std::size_t(top)].next_item = std::uint32_t(int(ret.m_tokens.size()) - top);
+					tokens[std::size_t(top)].next_item = std::uint32_t(int(tokens.size()) - top);
 
 					// and pop it from the stack.
 					assert(sp > 0);
@@ -914,19 +917,18 @@ namespace detail {
 					if (start - str_start - 2 > detail::bdecode_token::max_header)
 						TORRENT_FAIL_BDECODE(bdecode_errors::limit_exceeded);
 
-					ret.m_tokens.push_back({str_start - orig_start
+					tokens.push_back({str_start - orig_start
 						, 1, bdecode_token::string, std::uint8_t(start - str_start)});
 					start += len;
 					break;
 				}
 			}
 
-			if (current_frame > 0
-				&& ret.m_tokens[stack[current_frame - 1].token].type == bdecode_token::dict)
+			if (parent_dict)
 			{
 				// the next item we parse is the opposite
 				// state is an unsigned 1-bit member. adding 1 will flip the bit
-				stack[current_frame - 1].state = (stack[current_frame - 1].state + 1) & 1;
+				parent_dict->state = (parent_dict->state + 1) & 1;
 			}
 
 			// this terminates the top level node, we're done!
@@ -944,30 +946,255 @@ done:
 
 			// we may need to insert a dummy token to properly terminate the tree,
 			// in case we just parsed a key to a dict and failed in the value
-			if (ret.m_tokens[stack[sp].token].type == bdecode_token::dict
-				&& stack[sp].state == 1)
+			if (stack[sp].dict && stack[sp].state == 1)
 			{
 				// insert an empty dictionary as the value
-				ret.m_tokens.push_back({start - orig_start, 2, bdecode_token::dict});
-				ret.m_tokens.push_back({start - orig_start, bdecode_token::end});
+				tokens.push_back({start - orig_start, 2, bdecode_token::dict});
+				tokens.push_back({start - orig_start, bdecode_token::end});
 			}
 
 			int const top = stack[sp].token;
-			assert(int(ret.m_tokens.size()) - top <= bdecode_token::max_next_item);
-			ret.m_tokens[std::size_t(top)].next_item = std::uint32_t(int(ret.m_tokens.size()) - top);
-			ret.m_tokens.push_back({start - orig_start, 1, bdecode_token::end});
+			assert(int(tokens.size()) - top <= bdecode_token::max_next_item);
+			tokens[std::size_t(top)].next_item = std::uint32_t(int(tokens.size()) - top);
+			tokens.push_back({start - orig_start, 1, bdecode_token::end});
 		}
 
-		ret.m_tokens.push_back({start - orig_start, 0, bdecode_token::end});
+		tokens.push_back({start - orig_start, 0, bdecode_token::end});
+
+		return int(start - orig_start);
+	}
+
+} // namespace detail
+
+	bdecode_node bdecode(span<char const> buffer
+		, error_code& ec, int* error_pos, int token_limit)
+	{
+		bdecode_node ret;
+		int const size = detail::bdecode_tokens(ret.m_tokens, buffer, ec, error_pos, token_limit);
+		if (size < 0) return ret;
 
 		ret.m_token_idx = 0;
-		ret.m_buffer = orig_start;
-		ret.m_buffer_size = int(start - orig_start);
+		ret.m_buffer = buffer.data();
+		ret.m_buffer_size = size;
 		ret.m_root_tokens = ret.m_tokens.data();
-
 		return ret;
 	}
 
+	bdecode_node bdecode_context::decode(span<char const> buffer
+		, error_code& ec, int* error_pos, int token_limit)
+	{
+		// clear() keeps the capacity, once it has grown large enough, decoding
+		// doesn't allocate
+		m_tokens.clear();
+		int const size = detail::bdecode_tokens(m_tokens, buffer, ec, error_pos, token_limit);
+		if (size < 0) return bdecode_node();
+		return bdecode_node(m_tokens.data(), buffer.data(), size, 0);
+	}
+
+	void bdecode_context::reserve(int const tokens)
+	{
+		m_tokens.reserve(std::size_t(tokens));
+	}
+
+	int bdecode_stream::next(span<char const> const buf, item& out)
+	{
+		out = item();
+		int const size = int(buf.size());
+
+		// once the input has been rejected (or the top level item is
+		// complete), the rest of it is ignored
+		if (m_error || m_state == state_t::done)
+		{
+			m_bytes += size;
+			return size;
+		}
+
+		int i = 0;
+		// an empty string is complete as soon as its colon is parsed
+		while (i < size || (m_state == state_t::string && m_length == 0))
+		{
+			char const c = i < size ? buf[i] : '\0';
+			bool const in_dict = m_depth > 0 && (m_stack[std::size_t(m_depth - 1)] & 1);
+			bool const dict_value = in_dict && (m_stack[std::size_t(m_depth - 1)] & 2);
+
+			switch (m_state)
+			{
+				case state_t::value:
+				{
+					// keys must be strings
+					if (in_dict && !dict_value && !numeric(c) && c != 'e')
+						return fail(bdecode_errors::expected_digit, i, size);
+
+					switch (c)
+					{
+						case 'd':
+						case 'l':
+							if (m_depth >= depth_limit)
+								return fail(bdecode_errors::depth_exceeded, i, size);
+							// the container is an item of its parent, the
+							// parent's next item is a key (if it's a dictionary)
+							end_item();
+							push(c == 'd');
+							break;
+						case 'i':
+							m_state = state_t::int_first;
+							m_value = 0;
+							m_digits = 0;
+							m_negative = false;
+							break;
+						case 'e':
+							if (m_depth == 0)
+								return fail(bdecode_errors::unexpected_eof, i, size);
+							if (dict_value)
+								return fail(bdecode_errors::expected_value, i, size);
+							--m_depth;
+							if (m_depth == 0) m_state = state_t::done;
+							break;
+						default:
+							if (!numeric(c))
+								return fail(bdecode_errors::expected_value, i, size);
+							m_state = state_t::length;
+							m_length = c - '0';
+							m_digits = 1;
+							break;
+					}
+					++i;
+					if (m_state == state_t::done)
+					{
+						m_bytes += size;
+						return size;
+					}
+					break;
+				}
+				case state_t::int_first:
+					m_state = state_t::int_digits;
+					if (c == '-')
+					{
+						m_negative = true;
+						++i;
+					}
+					break;
+				case state_t::int_digits:
+				{
+					if (c == 'e' && m_digits > 0)
+					{
+						out.type = item::int_t;
+						out.depth = m_depth;
+						out.dict_value = dict_value;
+						out.value = m_negative ? -m_value : m_value;
+						end_item();
+						++i;
+						m_bytes += i;
+						return i;
+					}
+					if (!numeric(c))
+						return fail(bdecode_errors::expected_digit, i, size);
+					int const digit = c - '0';
+					if (m_value > (std::numeric_limits<std::int64_t>::max() - digit) / 10)
+						return fail(bdecode_errors::overflow, i, size);
+					m_value = m_value * 10 + digit;
+					++m_digits;
+					++i;
+					break;
+				}
+				case state_t::length:
+				{
+					if (c == ':')
+					{
+						m_key_size = 0;
+						m_key_truncated = false;
+						m_state = state_t::string;
+						++i;
+						break;
+					}
+					if (!numeric(c))
+						return fail(bdecode_errors::expected_digit, i, size);
+					// bdecode() doesn't allow length prefixes longer than this
+					// either. It also means the length can't overflow
+					if (++m_digits > detail::bdecode_token::max_header + 1)
+						return fail(bdecode_errors::limit_exceeded, i, size);
+					m_length = m_length * 10 + (c - '0');
+					++i;
+					break;
+				}
+				case state_t::string:
+				{
+					// the whole string may already have been consumed
+					int const n = int(std::min(std::int64_t(size - i), m_length));
+					bool const report = in_dict && !dict_value;
+					if (report)
+					{
+						int const copy = std::min(n, int(max_key) - m_key_size);
+						std::memcpy(m_key.data() + m_key_size, buf.data() + i, std::size_t(copy));
+						m_key_size += copy;
+						if (copy < n) m_key_truncated = true;
+					}
+					m_length -= n;
+					i += n;
+					if (m_length > 0) break;
+
+					end_item();
+					if (report)
+					{
+						out.type = item::key_t;
+						out.depth = m_depth;
+						out.key = string_view(m_key.data(), std::size_t(m_key_size));
+						out.truncated = m_key_truncated;
+						m_bytes += i;
+						return i;
+					}
+					if (m_state == state_t::done)
+					{
+						m_bytes += size;
+						return size;
+					}
+					break;
+				}
+				case state_t::done:
+					break;
+			}
+		}
+		m_bytes += i;
+		return i;
+	}
+
+	error_code bdecode_stream::finish()
+	{
+		if (!m_error && m_state != state_t::done)
+		{
+			// like bdecode(), a length prefix cut short after its first digit
+			// is missing its colon
+			m_error = m_state == state_t::length && m_digits > 1
+				? bdecode_errors::expected_colon : bdecode_errors::unexpected_eof;
+			m_error_pos = m_bytes;
+		}
+		return m_error;
+	}
+
+	int bdecode_stream::fail(bdecode_errors::error_code_enum const e, int const pos
+		, int const size)
+	{
+		m_error = e;
+		m_error_pos = m_bytes + pos;
+		// the rest of the input is consumed and ignored
+		m_bytes += size;
+		return size;
+	}
+
+	void bdecode_stream::push(bool const dict)
+	{
+		m_stack[std::size_t(m_depth)] = dict ? 1 : 0;
+		++m_depth;
+		m_state = state_t::value;
+	}
+
+	void bdecode_stream::end_item()
+	{
+		if (m_depth > 0 && (m_stack[std::size_t(m_depth - 1)] & 1))
+			m_stack[std::size_t(m_depth - 1)] ^= 2;
+		m_state = m_depth == 0 ? state_t::done : state_t::value;
+	}
+
 	namespace {
 
 	int line_longer_than(bdecode_node const& e, int limit)
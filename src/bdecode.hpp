@@ -33,6 +33,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include <vector>
+#include <array>
 #include <string>
 #include <cstdint>
 #include <cstddef>
@@ -230,6 +231,12 @@ struct bdecode_token
 	// prefix and always a colon, those 2 characters are implied.
 	std::uint32_t header:3;
 };
+
+// internal
+// parses "buffer" into "tokens" (which is expected to be empty). Returns the
+// number of bytes parsed, or -1 if the buffer couldn't be parsed at all
+int bdecode_tokens(std::vector<bdecode_token>& tokens, span<char const> buffer
+	, error_code& ec, int* error_pos, int token_limit);
 }
 
 // a ``bdecode_node`` is used to traverse and hold the tree structure defined
@@ -257,6 +264,7 @@ struct bdecode_node
 	// hidden
 	friend bdecode_node bdecode(span<char const> buffer
 		, error_code& ec, int* error_pos, int token_limit);
+	friend struct bdecode_context;
 
 	// creates a default constructed node, it will have the type ``none_t``.
 	bdecode_node() = default;
@@ -428,5 +436,111 @@ std::string print_entry(bdecode_node const& e
 bdecode_node bdecode(span<char const> buffer, error_code& ec
 	, int* error_pos = nullptr, int token_limit = 2000000);
 
-}
+// owns the token array of bencoded buffers decoded with it. The array is
+// reused by every call to decode(), so once it has grown large enough,
+// decoding doesn't allocate any memory.
+//
+// The node returned by decode() is *non-owning*. It, and any node derived from
+// it, is only valid until the next call to decode() or until the context is
+// destroyed. Just like with bdecode(), the buffer must also remain valid while
+// the nodes are used.
+struct bdecode_context
+{
+	bdecode_node decode(span<char const> buffer, error_code& ec
+		, int* error_pos = nullptr, int token_limit = 2000000);
+
+	// preallocate memory for the specified number of tokens
+	void reserve(int tokens);
+
+private:
+	std::vector<detail::bdecode_token> m_tokens;
+};
+
+// an incremental bdecoder, for bencoded data that arrives in pieces, e.g. a
+// message spread over many TCP segments. It validates the structure as bytes
+// are fed to it, without buffering them, so its memory use is fixed no matter
+// how large the input is. Malformed input is rejected at the first offending
+// byte, with the same errors as bdecode().
+//
+// It's a pull parser. next() consumes input until it has an item to report,
+// dictionary keys and integers, or until the input runs out. Keys longer than
+// max_key bytes are reported truncated, with the "truncated" flag set. String values and
+// container boundaries are not reported.
+struct bdecode_stream
+{
+	enum limits_t { max_key = 32, depth_limit = 100 };
 
+	struct item
+	{
+		enum type_t : std::uint8_t { none_t, key_t, int_t };
+		type_t type = none_t;
+		// the number of containers enclosing the item. Items of the top level
+		// dictionary or list are at depth 1
+		int depth = 0;
+		// set if the item is the value of a key in a dictionary
+		bool dict_value = false;
+		// valid for keys until the next call to next(). At most max_key bytes
+		string_view key;
+		// set if the key was longer than max_key, and "key" is only its prefix
+		bool truncated = false;
+		std::int64_t value = 0;
+	};
+
+	// consumes bytes from the front of "buf". Returns the number of bytes
+	// consumed, and whether an item was found in "out". Once an item has been
+	// reported, the remaining bytes should be passed to the next call.
+	// Bytes past the end of the top level item are consumed and ignored.
+	int next(span<char const> buf, item& out);
+
+	// call once all input has been fed. Returns the error the input was
+	// rejected with, or unexpected_eof if the top level item is incomplete
+	error_code finish();
+
+	bool failed() const { return bool(m_error); }
+	error_code error() const { return m_error; }
+
+	// the offset of the byte the input was rejected at
+	std::int64_t error_pos() const { return m_error_pos; }
+
+	// the number of bytes fed to the parser
+	std::int64_t bytes() const { return m_bytes; }
+
+	void reset() { *this = bdecode_stream(); }
+
+private:
+
+	enum class state_t : std::uint8_t
+	{ value, int_first, int_digits, length, string, done };
+
+	// rejects the input at offset "pos" into the "size" bytes passed to next().
+	// Returns the number of bytes consumed
+	int fail(bdecode_errors::error_code_enum e, int pos, int size);
+	void push(bool dict);
+	// called when a value, or a key, has been parsed
+	void end_item();
+
+	error_code m_error;
+	std::int64_t m_error_pos = -1;
+	std::int64_t m_bytes = 0;
+
+	// the length of the string being parsed, or the bytes left of it
+	std::int64_t m_length = 0;
+	// the integer being parsed, and its number of digits
+	std::int64_t m_value = 0;
+	int m_digits = 0;
+	bool m_negative = false;
+
+	// the (first max_key bytes of the) key being parsed
+	std::array<char, max_key> m_key;
+	int m_key_size = 0;
+	bool m_key_truncated = false;
+
+	state_t m_state = state_t::value;
+	int m_depth = 0;
+
+	// one entry per open container: bit 0 is set for dictionaries, bit 1
+	// when the next item is a dictionary value (rather than a key)
+	std::array<std::uint8_t, depth_limit> m_stack;
+};
+
+}
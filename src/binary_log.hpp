@@ -0,0 +1,485 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bt_event.hpp"
+#include "cast.hpp"
+#include "event_sink.hpp"
+#include "mapped_file.hpp"
+#include "async_writer.hpp"
+#include "str.hpp"
+
+// The binary event log is a single file made up of:
+//
+//   binary_log_header
+//   event_record[]       (the records of all streams, in extents)
+//   log_flow[]           (sorted by info-hash, then flow ID)
+//   log_extent[]         (the extents of each flow, in order)
+//   log_info_hash[]      (sorted)
+//   binary_log_trailer   (at the very end of the file)
+//
+// The records of a stream are buffered and appended in runs (extents), so
+// streams are interleaved in the file. The index at the end maps every flow
+// and info-hash to the extents holding its records, to let a reader mmap the
+// file and jump straight to them. All integers are in host byte order.
+
+constexpr char binary_log_magic[8] = {'T', 'B', 'T', 'L', 'O', 'G', '0', '1'};
+constexpr std::uint32_t binary_log_version = 1;
+
+struct binary_log_header
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t record_size;
+	std::uint8_t reserved[16];
+};
+
+// a run of consecutive records belonging to one flow
+struct log_extent
+{
+	// the index of the first record, counting from the first record after the
+	// header
+	std::uint64_t first_record;
+	std::uint64_t num_records;
+};
+
+struct log_flow
+{
+	std::uint64_t flow_id;
+	// index into the extents table
+	std::uint64_t first_extent;
+	std::uint32_t num_extents;
+	std::uint32_t src;
+	std::uint32_t dst;
+	std::uint16_t src_port;
+	std::uint16_t dst_port;
+	std::array<unsigned char, 20> info_hash;
+	std::uint32_t pad;
+
+	flow_info info() const
+	{
+		return flow_info{flow_id, info_hash
+			, stream_key{address_v4(src), address_v4(dst), src_port, dst_port}};
+	}
+};
+
+struct log_info_hash
+{
+	std::array<unsigned char, 20> info_hash;
+	std::uint32_t num_flows;
+	// index into the flows table
+	std::uint64_t first_flow;
+};
+
+// the tables are identified by their byte offset into the file
+struct binary_log_trailer
+{
+	std::uint64_t flows;
+	std::uint64_t num_flows;
+	std::uint64_t extents;
+	std::uint64_t num_extents;
+	std::uint64_t info_hashes;
+	std::uint64_t num_info_hashes;
+	char magic[8];
+};
+
+static_assert(sizeof(binary_log_header) == sizeof(event_record), "the header is expected to keep records aligned");
+static_assert(sizeof(log_flow) == 56, "log_flow is expected to be 56 bytes");
+static_assert(sizeof(log_info_hash) == 32, "log_info_hash is expected to be 32 bytes");
+
+inline binary_log_header make_binary_log_header()
+{
+	binary_log_header hdr{};
+	std::memcpy(hdr.magic, binary_log_magic, sizeof(hdr.magic));
+	hdr.version = binary_log_version;
+	hdr.record_size = sizeof(event_record);
+	return hdr;
+}
+
+// the index of a binary log being written. As extents of records are appended
+// to the file, this keeps track of which flow they belong to. Once all records
+// have been written, footer() is appended to complete the file.
+struct binary_log_index
+{
+	std::uint32_t add_flow(flow_info const& f)
+	{
+		m_flows.push_back(flow{f, {}});
+		return std::uint32_t(m_flows.size() - 1);
+	}
+
+	// "n" records of "flow" are appended to the file. Returns the byte offset
+	// to write them at
+	std::uint64_t add_extent(std::uint32_t const flow, std::uint64_t const n)
+	{
+		std::uint64_t const ret = sizeof(binary_log_header) + m_num_records * sizeof(event_record);
+		m_flows[flow].extents.push_back(log_extent{m_num_records, n});
+		m_num_records += n;
+		return ret;
+	}
+
+	std::uint64_t num_records() const { return m_num_records; }
+
+	// the flows, extents and info-hash tables, followed by the trailer
+	std::vector<char> footer() const
+	{
+		std::vector<std::uint32_t> order(m_flows.size());
+		for (std::uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+		std::sort(order.begin(), order.end(), [this](std::uint32_t const lhs, std::uint32_t const rhs)
+		{
+			auto const& l = m_flows[lhs].info;
+			auto const& r = m_flows[rhs].info;
+			if (l.info_hash != r.info_hash) return l.info_hash < r.info_hash;
+			return l.flow_id < r.flow_id;
+		});
+
+		std::vector<log_flow> flows;
+		std::vector<log_extent> extents;
+		std::vector<log_info_hash> info_hashes;
+		flows.reserve(order.size());
+		for (auto const i : order) {
+			auto const& f = m_flows[i];
+			log_flow lf{};
+			lf.flow_id = f.info.flow_id;
+			lf.first_extent = extents.size();
+			lf.num_extents = std::uint32_t(f.extents.size());
+			lf.src = std::uint32_t(f.info.key.src.to_ulong());
+			lf.dst = std::uint32_t(f.info.key.dst.to_ulong());
+			lf.src_port = f.info.key.src_port;
+			lf.dst_port = f.info.key.dst_port;
+			lf.info_hash = f.info.info_hash;
+			extents.insert(extents.end(), f.extents.begin(), f.extents.end());
+
+			if (info_hashes.empty() || info_hashes.back().info_hash != lf.info_hash)
+				info_hashes.push_back(log_info_hash{lf.info_hash, 0, flows.size()});
+			++info_hashes.back().num_flows;
+			flows.push_back(lf);
+		}
+
+		binary_log_trailer t{};
+		t.flows = sizeof(binary_log_header) + m_num_records * sizeof(event_record);
+		t.num_flows = flows.size();
+		t.extents = t.flows + flows.size() * sizeof(log_flow);
+		t.num_extents = extents.size();
+		t.info_hashes = t.extents + extents.size() * sizeof(log_extent);
+		t.num_info_hashes = info_hashes.size();
+		std::memcpy(t.magic, binary_log_magic, sizeof(t.magic));
+
+		std::vector<char> ret;
+		append(ret, flows.data(), flows.size() * sizeof(log_flow));
+		append(ret, extents.data(), extents.size() * sizeof(log_extent));
+		append(ret, info_hashes.data(), info_hashes.size() * sizeof(log_info_hash));
+		append(ret, &t, sizeof(t));
+		return ret;
+	}
+
+private:
+
+	static void append(std::vector<char>& buf, void const* data, std::size_t const size)
+	{
+		auto const* ptr = static_cast<char const*>(data);
+		buf.insert(buf.end(), ptr, ptr + size);
+	}
+
+	struct flow
+	{
+		flow_info info;
+		std::vector<log_extent> extents;
+	};
+
+	std::uint64_t m_num_records = 0;
+	std::vector<flow> m_flows;
+};
+
+// buffers the records of a stream and hands them to Sink::append() in extents.
+// Blobs are stored as records following the event
+template <typename Sink>
+struct buffered_flow_log final : flow_log
+{
+	using handle_t = typename Sink::flow_handle;
+
+	buffered_flow_log(Sink& s, handle_t const h) : m_sink(s), m_flow(h) {}
+
+	buffered_flow_log(buffered_flow_log const&) = delete;
+	buffered_flow_log& operator=(buffered_flow_log const&) = delete;
+
+	void write(event_record const& e, span<unsigned char const> blob) override
+	{
+		if (std::size_t(blob.size()) > max_blob_size) blob = blob.first(max_blob_size);
+		std::size_t const blob_records = (std::size_t(blob.size()) + sizeof(event_record) - 1)
+			/ sizeof(event_record);
+
+		m_records.push_back(e);
+		m_records.back().blob_records = std::uint16_t(blob_records);
+		if (!blob.empty()) m_records.back().length = std::uint32_t(blob.size());
+
+		std::size_t const pos = m_records.size();
+		m_records.resize(pos + blob_records, event_record{});
+		if (!blob.empty()) std::memcpy(&m_records[pos], blob.data(), std::size_t(blob.size()));
+
+		if (m_records.size() >= flush_records) flush();
+	}
+
+	~buffered_flow_log() { flush(); }
+
+private:
+
+	// the records of a stream are buffered until there are this many of them.
+	// The buffer grows as needed, quiet streams don't hold on to all of it
+	static constexpr std::size_t flush_records = 64;
+
+	void flush()
+	{
+		if (m_records.empty()) return;
+		m_sink.append(m_flow, m_records);
+		m_records.clear();
+	}
+
+	Sink& m_sink;
+	handle_t m_flow;
+	std::vector<event_record> m_records;
+};
+
+// writes the events of all streams to a single binary log. Streams may be
+// logged from any number of threads
+struct binary_sink final : event_sink
+{
+	// the index of the flow in m_index
+	using flow_handle = std::uint32_t;
+
+	binary_sink(std::string const& path, async_writer& w)
+		: m_writer(w)
+		, m_file(w.add_file(path, true))
+	{
+		binary_log_header const hdr = make_binary_log_header();
+		auto const* ptr = reinterpret_cast<char const*>(&hdr);
+		m_block.reserve(block_size);
+		m_block.assign(ptr, ptr + sizeof(hdr));
+	}
+
+	binary_sink(binary_sink const&) = delete;
+	binary_sink& operator=(binary_sink const&) = delete;
+
+	~binary_sink() { close(); }
+
+	std::unique_ptr<flow_log> open_flow(flow_info const& f) override
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		return std::make_unique<buffered_flow_log<binary_sink>>(*this, m_index.add_flow(f));
+	}
+
+	// hands the remaining records and the index to the writer. All flow logs
+	// must have been destroyed by now. The log is complete once the writer is
+	// closed
+	void close()
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		if (m_closed) return;
+		m_closed = true;
+		auto const footer = m_index.footer();
+		m_block.insert(m_block.end(), footer.begin(), footer.end());
+		write_block();
+	}
+
+	void append(flow_handle const flow, std::vector<event_record> const& records)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_index.add_extent(flow, records.size());
+		auto const* ptr = reinterpret_cast<char const*>(records.data());
+		m_block.insert(m_block.end(), ptr, ptr + records.size() * sizeof(event_record));
+		if (m_block.size() >= block_size) write_block();
+	}
+
+private:
+
+	// records are written in blocks of (at least) this size
+	static constexpr std::size_t block_size = 128 * 1024;
+
+	// the block is swapped with a buffer the writer is done with
+	void write_block()
+	{
+		if (m_block.empty()) return;
+		std::uint64_t const offset = m_written;
+		m_written += m_block.size();
+		m_writer.write(m_file, offset, m_block);
+		m_block.reserve(block_size);
+	}
+
+	async_writer& m_writer;
+	std::uint32_t const m_file;
+
+	// protects everything below
+	std::mutex m_mutex;
+	binary_log_index m_index;
+	// the bytes not yet handed to the writer, starting at file offset
+	// "m_written"
+	std::vector<char> m_block;
+	std::uint64_t m_written = 0;
+	bool m_closed = false;
+};
+
+// a memory mapped binary event log
+struct binary_log_reader
+{
+	explicit binary_log_reader(char const* path)
+		: m_file(path)
+	{
+		if (!m_file.is_open())
+			throw std::runtime_error(str("failed to open \"", path, "\""));
+
+		auto const buf = m_file.data();
+		auto const& hdr = cast<binary_log_header>(buf);
+		if (std::memcmp(hdr.magic, binary_log_magic, sizeof(hdr.magic)) != 0
+			|| hdr.version != binary_log_version
+			|| hdr.record_size != sizeof(event_record)
+			|| buf.size() < std::ptrdiff_t(sizeof(binary_log_header) + sizeof(binary_log_trailer)))
+			throw std::runtime_error(str("\"", path, "\" is not a binary event log"));
+
+		auto const& t = cast<binary_log_trailer>(buf.last(sizeof(binary_log_trailer)));
+		std::uint64_t const end = std::uint64_t(buf.size()) - sizeof(binary_log_trailer);
+		if (std::memcmp(t.magic, binary_log_magic, sizeof(t.magic)) != 0
+			|| t.flows < sizeof(binary_log_header)
+			|| (t.flows - sizeof(binary_log_header)) % sizeof(event_record) != 0
+			|| t.extents != t.flows + t.num_flows * sizeof(log_flow)
+			|| t.info_hashes != t.extents + t.num_extents * sizeof(log_extent)
+			|| end != t.info_hashes + t.num_info_hashes * sizeof(log_info_hash))
+			throw std::runtime_error(str("\"", path, "\" has a corrupt index (was tracebt interrupted?)"));
+
+		m_records = {reinterpret_cast<event_record const*>(buf.data() + sizeof(binary_log_header))
+			, std::ptrdiff_t((t.flows - sizeof(binary_log_header)) / sizeof(event_record))};
+		m_flows = {reinterpret_cast<log_flow const*>(buf.data() + t.flows), std::ptrdiff_t(t.num_flows)};
+		m_extents = {reinterpret_cast<log_extent const*>(buf.data() + t.extents), std::ptrdiff_t(t.num_extents)};
+		m_info_hashes = {reinterpret_cast<log_info_hash const*>(buf.data() + t.info_hashes)
+			, std::ptrdiff_t(t.num_info_hashes)};
+	}
+
+	span<log_flow const> flows() const { return m_flows; }
+	span<log_info_hash const> info_hashes() const { return m_info_hashes; }
+	span<event_record const> records() const { return m_records; }
+
+	// the flows of a torrent
+	span<log_flow const> flows(log_info_hash const& ih) const
+	{
+		if (ih.first_flow + ih.num_flows > std::uint64_t(m_flows.size()))
+			throw std::runtime_error("binary log: info-hash refers to invalid flows");
+		return m_flows.subspan(std::ptrdiff_t(ih.first_flow), ih.num_flows);
+	}
+
+	// calls "fun" with every event of the flow, in order, along with its blob
+	template <typename Fun>
+	void for_each_event(log_flow const& f, Fun&& fun) const
+	{
+		if (f.first_extent + f.num_extents > std::uint64_t(m_extents.size()))
+			throw std::runtime_error("binary log: flow refers to invalid extents");
+
+		// a blob may span the end of an extent, in which case it's assembled
+		// here
+		std::vector<event_record> blob;
+		event_record pending{};
+		std::size_t blob_left = 0;
+
+		for (auto const& ext : m_extents.subspan(std::ptrdiff_t(f.first_extent), f.num_extents)) {
+			if (ext.first_record + ext.num_records > std::uint64_t(m_records.size()))
+				throw std::runtime_error("binary log: extent refers to invalid records");
+			auto records = m_records.subspan(std::ptrdiff_t(ext.first_record), std::ptrdiff_t(ext.num_records));
+
+			while (!records.empty()) {
+				if (blob_left > 0) {
+					std::size_t const n = std::min(blob_left, std::size_t(records.size()));
+					blob.insert(blob.end(), records.begin(), records.begin() + n);
+					records = records.subspan(std::ptrdiff_t(n));
+					blob_left -= n;
+					if (blob_left == 0) fun(pending, blob_bytes(pending, blob));
+					continue;
+				}
+
+				event_record const& e = records[0];
+				records = records.subspan(1);
+				if (e.blob_records == 0) {
+					fun(e, span<unsigned char const>());
+				}
+				else if (records.size() >= e.blob_records) {
+					// the common case, the blob is right here
+					fun(e, blob_bytes(e, records.first(e.blob_records)));
+					records = records.subspan(e.blob_records);
+				}
+				else {
+					pending = e;
+					blob.clear();
+					blob_left = e.blob_records;
+				}
+			}
+		}
+		if (blob_left > 0)
+			throw std::runtime_error("binary log: truncated event");
+	}
+
+private:
+
+	static span<unsigned char const> blob_bytes(event_record const& e, span<event_record const> records)
+	{
+		std::size_t const size = std::min(std::size_t(e.length)
+			, std::size_t(records.size()) * sizeof(event_record));
+		return {reinterpret_cast<unsigned char const*>(records.data()), std::ptrdiff_t(size)};
+	}
+
+	mapped_file m_file;
+	span<event_record const> m_records;
+	span<log_flow const> m_flows;
+	span<log_extent const> m_extents;
+	span<log_info_hash const> m_info_hashes;
+};
+
+// logs the events of every stream of a torrent to "sink", one stream at a time.
+// Returns the number of events
+inline std::uint64_t replay(binary_log_reader const& log, log_info_hash const& ih, event_sink& sink)
+{
+	std::uint64_t events = 0;
+	for (auto const& f : log.flows(ih)) {
+		auto out = sink.open_flow(f.info());
+		log.for_each_event(f, [&](event_record const& e, span<unsigned char const> blob)
+		{
+			out->write(e, blob);
+			++events;
+		});
+	}
+	return events;
+}
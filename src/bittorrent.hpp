@@ -34,18 +34,17 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "tcp_state.hpp"
 #include "bdecode.hpp"
-
-#include <bitset>
+#include "payload_arena.hpp"
+#include "bt_event.hpp"
+#include "event_sink.hpp"
+#include "flow_filter.hpp"
+#include "request_tracker.hpp"
+#include "rate_profile.hpp"
 
 using boost::system::error_code;
-using libtorrent::bdecode;
+using libtorrent::bdecode_context;
 using libtorrent::bdecode_node;
 
-inline std::ostream& operator<<(std::ostream& os, timeval const& ts)
-{
-	return os << ts.tv_sec << '.' << std::setfill('0') << std::setw(3) << ts.tv_usec / 1000;
-}
-
 enum class state_t : std::uint8_t {
 	protocol,
 	reserved,
@@ -53,16 +52,9 @@ enum class state_t : std::uint8_t {
 	peer_id,
 	length,
 	msg,
-	have,
-	dht_port,
-	allowed_fast,
-	request,
-	piece,
-	cancel,
-	suggest,
-	reject,
+	// the fixed size header of the current message
+	header,
 	bitfield,
-	extension,
 	extension_handshake,
 	skip
 };
@@ -72,11 +64,33 @@ struct bittorrent_side_state
 	std::uint32_t skip_ = 0;
 	std::uint64_t offset_ = 0;
 	state_t state_ = state_t::protocol;
-	std::vector<unsigned char> buffer_;
-	std::vector<unsigned char> reserved_;
+	// the ID of the message being parsed
+	std::uint8_t msg_ = 0;
+	// allocated from the payload arena
+	using buffer_t = std::vector<unsigned char, arena_allocator<unsigned char, arena_tag::bittorrent>>;
+	buffer_t buffer_;
+	buffer_t reserved_;
+	// the peer supports the fast extension
+	bool fast_ = false;
+	// set while skipping the block of a PIECE message with a valid length
+	bool in_piece_ = false;
+
+	// fixed size message headers straddling two segments are assembled here
+	std::array<unsigned char, 13> scratch_;
+	std::uint8_t scratch_size_ = 0;
 
 	std::map<int, std::string> extensions_;
 
+	// the extension handshake is validated, and the extensions in its "m"
+	// dictionary picked up, as it arrives. Only handshakes of up to
+	// max_logged_handshake bytes are buffered (in buffer_), to be logged
+	static constexpr std::uint32_t max_logged_handshake = 0x10000;
+	libtorrent::bdecode_stream handshake_;
+	// set while parsing the value of the "m" key
+	bool in_m_ = false;
+	// the name of the extension whose ID is parsed next
+	std::string extension_name_;
+
 	// make sure our internal buffer has at least "bytes" bytes in it
 	span<unsigned char const> ensure_buffer(span<unsigned char const> buf, int const bytes)
 	{
@@ -85,19 +99,29 @@ struct bittorrent_side_state
 		buffer_.insert(buffer_.end(), buf.data(), buf.data() + overlap);
 		return buf.subspan(overlap);
 	}
-};
-
-std::string msg_type_name(int const msg)
-{
-	std::array<char const*, 21> message_name = {{"choke", "unchoke", "interested", "not_interested"
-		, "have", "bitfield", "request", "piece", "cancel", "dht_port", "??", "??", "??"
-		, "suggest_piece", "have_all", "have_none", "reject_request", "allowed_fast", "??", "??", "extension-msg"}};
 
-	if (msg >= 0 && static_cast<std::size_t>(msg) < message_name.size()) {
-		return message_name[msg];
+	// returns the "bytes" byte header at the front of "buf" and moves "buf"
+	// past it. In the common case, the header is decoded in place. If "buf"
+	// ends before the header does, what there is of it is saved in scratch_ and
+	// an empty span is returned. The next call picks up where this left off and
+	// returns the header out of scratch_.
+	span<unsigned char const> fixed_header(span<unsigned char const>& buf, int const bytes)
+	{
+		assert(bytes <= int(scratch_.size()));
+		if (scratch_size_ == 0 && buf.size() >= bytes) {
+			auto const ret = buf.first(bytes);
+			buf = buf.subspan(bytes);
+			return ret;
+		}
+		int const overlap = std::min(int(buf.size()), bytes - scratch_size_);
+		std::memcpy(scratch_.data() + scratch_size_, buf.data(), std::size_t(overlap));
+		scratch_size_ += std::uint8_t(overlap);
+		buf = buf.subspan(overlap);
+		if (scratch_size_ < bytes) return {};
+		scratch_size_ = 0;
+		return {scratch_.data(), bytes};
 	}
-	return "?? (" + std::to_string(msg) + ")";
-}
+};
 
 std::uint32_t read_u32(span<unsigned char const> buf)
 {
@@ -115,75 +139,113 @@ std::uint16_t read_u16(span<unsigned char const> buf)
 		| std::uint16_t(buf[1]);
 }
 
-dir_t opposite(dir_t const d)
-{
-	return d == dir_t::in ? dir_t::out : dir_t::in;
-}
+struct parse_bittorrent;
 
-std::string printable(span<unsigned char const> bytes)
+// how the size of a message (excluding the message ID) relates to the size of
+// its fixed header
+enum class size_rule : std::uint8_t { exact, at_least, any };
+
+// describes how to parse a message type. Once the fixed size header
+// ("header" bytes) following the message ID has been received, it's passed to
+// "handler", which is also responsible for picking the next state
+struct message_descriptor
 {
-	std::string ret;
-	for (auto const c : bytes) {
-		if (c >= ' ' && c < 127) ret += c;
-		else ret += '.';
+	std::uint8_t header;
+	size_rule rule;
+	void (parse_bittorrent::*handler)(timeval const& ts, dir_t d
+		, bittorrent_side_state& s, message_descriptor const& m
+		, span<unsigned char const> hdr);
+
+	// "size" is the size of the message, excluding its ID
+	constexpr bool valid_size(std::uint32_t const size) const
+	{
+		switch (rule) {
+			case size_rule::exact: return size == header;
+			case size_rule::at_least: return size >= header;
+			case size_rule::any: return true;
+		}
+		return false;
 	}
-	return ret;
-}
+};
+
+// where the statistics of streams go. Any of them may be null
+struct stats_logs
+{
+	latency_log* latency = nullptr;
+	queue_log* queue = nullptr;
+	rate_log* rates = nullptr;
+};
 
 struct parse_bittorrent
 {
-	parse_bittorrent(stream_key const& key)
+	// the stream is logged to "sink" once its info-hash is known, unless it's
+	// a torrent "filter" doesn't match. The statistics of the stream are handed
+	// to "logs" as it's torn down
+	parse_bittorrent(stream_key const& key, std::uint64_t const flow_id, event_sink& sink
+		, flow_filter const& filter, stats_logs const& logs)
 		: key_(key)
+		, flow_id_(flow_id)
+		, sink_(&sink)
+		, filter_(&filter)
+		, logs_(logs)
+	{
+		if (logs_.rates) rates_ = std::make_unique<rate_profile>(*logs_.rates, flow_id);
+	}
+
+	// "bytes" of TCP or uTP payload arrived, whether they're in order or not,
+	// and even in a direction the transport no longer delivers data for
+	void transport(timeval const& ts, std::size_t const bytes, dir_t const d)
 	{
+		if (rates_) rates_->transport(to_timestamp(ts), d, std::uint32_t(bytes));
+		if (requests_) requests_->seen(to_timestamp(ts));
 	}
 
 	void event(timeval const& ts, socket_event_t e, dir_t d)
 	{
-		log_ << d << ' ' << ts << ' ' << e << '\n';
+		if (requests_) requests_->seen(to_timestamp(ts));
+		emit(ts, d, to_event(e));
 	}
 
-	void check_zero(bittorrent_side_state& s, dir_t const d)
+	// called as the stream is torn down, if packets arrived out of order.
+	// "depth" is the furthest ahead (in packets) any packet arrived
+	void reorder_depth(dir_t const d, int const depth)
 	{
-		if (s.skip_ == 0) s.state_ = state_t::length;
-		else {
-			log_ << d << " ERROR: unexpected bytes after message: " << s.skip_ << '\n';
-			s.state_ = state_t::skip;
-		}
+		emit(timeval{}, d, event_type::reorder_depth, 0, 0, std::uint32_t(depth));
 	}
 
-	void data(timeval const& ts, span<unsigned char const> buf, dir_t d)
+	// returns verdict::drop once it's clear the stream isn't BitTorrent, or
+	// isn't one of the torrents we're following
+	verdict data(timeval const& ts, span<unsigned char const> buf, dir_t d)
 	{
 		// we're not following this stream
-		if (disabled_) return;
+		if (disabled_) return verdict::drop;
 		if (buf.empty()) {
-			if (log_.is_open()) log_ << d << ' ' << ts << " ACK\n";
-			return;
+			emit(ts, d, event_type::ack);
+			return verdict::keep;
 		}
 
 		auto& s = state_[d];
 		if (s.state_ == state_t::protocol) {
 			buf = s.ensure_buffer(buf, 20);
-			if (s.buffer_.size() < 20) return;
+			if (s.buffer_.size() < 20) return verdict::keep;
 
 			char const handshake[] = "\x13" "BitTorrent protocol";
 			if (memcmp(s.buffer_.data(), handshake, sizeof(handshake) - 1) != 0) {
-				disabled_ = true;
-				return;
+				return drop();
 			}
 			s.buffer_.clear();
 			s.offset_ += 20;
-			if (log_.is_open()) log_ << d << ' ' << ts << " HANDSHAKE\n";
+			emit(ts, d, event_type::handshake);
 			s.state_ = state_t::reserved;
 		}
 
 		if (s.state_ == state_t::reserved) {
 			buf = s.ensure_buffer(buf, 8);
-			if (s.buffer_.size() < 8) return;
+			if (s.buffer_.size() < 8) return verdict::keep;
 
-			if (log_.is_open()) {
-				log_ << d << ' ' << ts << " RESERVED " << std::hex;
-				for (auto const c : s.buffer_) log_ << std::setw(2) << std::setfill('0') << int(c);
-				log_ << std::dec << '\n';
+			s.fast_ = (s.buffer_[7] & 0x04) != 0;
+			if (log_) {
+				emit(ts, d, event_type::reserved, 0, 0, 0, s.buffer_);
 			}
 			else {
 				s.reserved_ = std::move(s.buffer_);
@@ -195,26 +257,20 @@ struct parse_bittorrent
 
 		if (s.state_ == state_t::info_hash) {
 			buf = s.ensure_buffer(buf, 20);
-			if (s.buffer_.size() < 20) return;
-
-			std::stringstream ih;
-			ih << std::hex;
-			for (auto const c : s.buffer_) ih << std::setw(2) << std::setfill('0') << int(c);
-
-			if (!log_.is_open()) {
-				mkdir("bt", 0755);
-				mkdir(("bt/" + ih.str()).c_str(), 0755);
-				static int stream_cnt = 0;
-				log_.open(str("bt/", ih.str(), "/", key_.src, ".", key_.src_port, "_", key_.dst, ".", key_.dst_port, "_", stream_cnt));
-				++stream_cnt;
-				log_ << d << ' ' << ts << " HANDSHAKE\n";
-				log_ << d << ' ' << ts << " RESERVED " << std::hex;
-				for (auto const c : s.reserved_) log_ << std::setw(2) << std::setfill('0') << int(c);
-				log_ << std::dec << '\n';
+			if (s.buffer_.size() < 20) return verdict::keep;
+
+			if (!log_) {
+				if (!filter_->match_info_hash(s.buffer_)) return drop();
+				flow_info f{flow_id_, {}, key_};
+				std::copy(s.buffer_.begin(), s.buffer_.end(), f.info_hash.begin());
+				log_ = sink_->open_flow(f);
+				if (logs_.latency || logs_.queue)
+					requests_ = std::make_unique<request_tracker>(f, logs_.latency, logs_.queue);
+				if (rates_) rates_->follow(f);
+				emit(ts, d, event_type::handshake);
+				emit(ts, d, event_type::reserved, 0, 0, 0, s.reserved_);
 			}
-			log_ << d << ' ' << ts << " INFO-HASH " << std::hex;
-			for (auto const c : s.buffer_) log_ << std::setw(2) << std::setfill('0') << int(c);
-			log_ << std::dec << '\n';
+			emit(ts, d, event_type::info_hash, 0, 0, 0, s.buffer_);
 			s.buffer_.clear();
 			s.offset_ += 20;
 			s.state_ = state_t::peer_id;
@@ -222,252 +278,373 @@ struct parse_bittorrent
 
 		if (s.state_ == state_t::peer_id) {
 			buf = s.ensure_buffer(buf, 20);
-			if (s.buffer_.size() < 20) return;
+			if (s.buffer_.size() < 20) return verdict::keep;
 
-			log_ << d << ' ' << ts << " PEER-ID " << std::hex;
-			for (auto const c : s.buffer_) log_ << std::setw(2) << std::setfill('0') << int(c);
-			log_ << std::dec << " [" << printable(s.buffer_) << "]\n";
+			emit(ts, d, event_type::peer_id, 0, 0, 0, s.buffer_);
 			s.buffer_.clear();
 			s.offset_ += 20;
 			s.state_ = state_t::length;
 		}
 
-		while (buf.size() > 0) {
+		for (;;) {
+			switch (s.state_) {
+				case state_t::length:
+				{
+					auto const hdr = s.fixed_header(buf, 4);
+					if (hdr.empty()) return verdict::keep;
 
-			if (s.state_ == state_t::length) {
-				buf = s.ensure_buffer(buf, 4);
-				if (s.buffer_.size() < 4) return;
-
-				std::uint32_t const length = read_u32(s.buffer_);
-				if (length > 0x100000) {
-					log_ << d << ' ' << ts << " ERROR: message too large! " << length << " (" << std::hex << length << ")" << std::dec << '\n';
-				}
+					std::uint32_t const length = read_u32(hdr);
+					if (length > 0x100000) {
+						emit(ts, d, event_type::message_too_large, 0, 0, length);
+					}
 
-				s.offset_ += 4;
-				s.buffer_.clear();
+					s.offset_ += 4;
 
-				if (length == 0) {
-					// if skip is 0, this was a keep-alive message. The next state
-					// should be to read another length prefix
-					log_ << d << ' ' << ts << " KEEP-ALIVE\n";
-				}
-				else {
-					s.skip_ = length;
-					s.state_ = state_t::msg;
+					if (length == 0) {
+						// if skip is 0, this was a keep-alive message. The next state
+						// should be to read another length prefix
+						emit(ts, d, event_type::keep_alive);
+					}
+					else {
+						s.skip_ = length;
+						s.state_ = state_t::msg;
 
-//					log_ << d << ' ' << ts << " length-prefix: " << length << "\n";
+					}
+					break;
 				}
-			}
-
-			if (s.state_ == state_t::msg) {
-				buf = s.ensure_buffer(buf, 1);
-				if (s.buffer_.size() < 1) return;
-
-				int const msg = s.buffer_[0];
-
-				s.offset_ += 1;
-				s.buffer_.clear();
-				s.skip_ -= 1;
-				switch (msg) {
-					case 0: log_ << d << ' ' << ts << " CHOKE\n"; check_zero(s, d); break;
-					case 1: log_ << d << ' ' << ts << " UNCHOKE\n"; check_zero(s, d); break;
-					case 2: log_ << d << ' ' << ts << " INTERESTED\n"; check_zero(s, d); break;
-					case 3: log_ << d << ' ' << ts << " NOT-INTERESTED\n"; check_zero(s, d); break;
-					case 4: s.state_ = state_t::have; break;
-					case 5: s.state_ = state_t::bitfield; break;
-					case 6: s.state_ = state_t::request; break;
-					case 7: s.state_ = state_t::piece; break;
-					case 8: s.state_ = state_t::cancel; break;
-					case 9: s.state_ = state_t::dht_port; break;
-					case 13: s.state_ = state_t::suggest; break;
-					case 14: log_ << d << ' ' << ts << " HAVE-ALL\n"; check_zero(s, d); break;
-					case 15: log_ << d << ' ' << ts << " HAVE-NONE\n"; check_zero(s, d); break;
-					case 16: s.state_ = state_t::reject; break;
-					case 17: s.state_ = state_t::allowed_fast; break;
-					case 20: s.state_ = state_t::extension; break;
-					default:
-						log_ << d << ' ' << ts << " msg: " << msg_type_name(msg) << '\n';
-						s.state_ = state_t::skip;
+				case state_t::msg:
+				{
+					auto const hdr = s.fixed_header(buf, 1);
+					if (hdr.empty()) return verdict::keep;
+
+					s.msg_ = hdr[0];
+					s.in_piece_ = false;
+					s.offset_ += 1;
+					s.skip_ -= 1;
+
+					// the length prefix tells us whether the message is well formed
+					// before we look at any of it
+					message_descriptor const& m = message_type(s.msg_);
+					if (!m.valid_size(s.skip_)) {
+						emit(ts, d, event_type::invalid_size, s.msg_, 0, s.skip_);
+						s.state_ = s.skip_ > 0 ? state_t::skip : state_t::length;
+						break;
+					}
+					if (m.header == 0) {
+						(this->*m.handler)(ts, d, s, m, {});
 						break;
+					}
+					s.state_ = state_t::header;
+					break;
 				}
-			}
-
-			if (s.state_ == state_t::have
-				|| s.state_ == state_t::allowed_fast
-				|| s.state_ == state_t::suggest)
-			{
-				buf = s.ensure_buffer(buf, 4);
-				if (s.buffer_.size() < 4) return;
-
-				std::uint32_t const piece = read_u32(s.buffer_);
-				switch (s.state_) {
-					case state_t::have: log_ << d << ' ' << ts << " HAVE " << piece <<"\n"; break;
-					case state_t::suggest: log_ << d << ' ' << ts << " SUGGEST " << piece <<"\n"; break;
-					case state_t::allowed_fast: log_ << d << ' ' << ts << " ALLOWED-FAST " << piece <<"\n"; break;
-					default: assert(false);
+				case state_t::header:
+				{
+					message_descriptor const& m = message_type(s.msg_);
+					auto const hdr = s.fixed_header(buf, m.header);
+					if (hdr.empty()) return verdict::keep;
+
+					s.offset_ += m.header;
+					s.skip_ -= m.header;
+					(this->*m.handler)(ts, d, s, m, hdr);
+					break;
 				}
+				case state_t::extension_handshake:
+				{
+					// the size of the whole handshake is bytes() + skip_
+					bool const logged = s.handshake_.bytes() + s.skip_
+						<= bittorrent_side_state::max_logged_handshake;
+
+					int const n = std::min(std::uint32_t(buf.size()), s.skip_);
+					auto const chunk = buf.first(n);
+					buf = buf.subspan(n);
+					s.offset_ += n;
+					s.skip_ -= n;
+
+					if (!s.handshake_.failed()) {
+						if (logged)
+							s.buffer_.insert(s.buffer_.end(), chunk.begin(), chunk.end());
+						parse_handshake(s, chunk);
+						// malformed handshakes are logged as soon as they're
+						// rejected, the rest of it is skipped
+						if (s.handshake_.failed()) {
+							emit(ts, d, event_type::extension_handshake, 0, 0, 0
+								, as_bytes(s.handshake_.error().message()));
+						}
+					}
+					if (s.skip_ > 0) return verdict::keep;
 
-				s.offset_ += 4;
-				s.buffer_.clear();
-				s.skip_ -= 4;
-				check_zero(s, d);
-			}
-
-			if (s.state_ == state_t::extension) {
-				buf = s.ensure_buffer(buf, 1);
-				if (s.buffer_.size() < 1) return;
+					if (!s.handshake_.failed()) {
+						error_code ec = s.handshake_.finish();
+						if (ec) {
+							emit(ts, d, event_type::extension_handshake, 0, 0, 0, as_bytes(ec.message()));
+						}
+						else if (!logged) {
+							emit(ts, d, event_type::extension_handshake, 0, 0, 0
+								, as_bytes("(" + std::to_string(s.handshake_.bytes()) + " bytes, not logged)"));
+						}
+						else {
+							// flows are pinned to a processor thread, so one token
+							// arena per thread is reused by every extension handshake
+							thread_local bdecode_context ctx;
+							auto e = ctx.decode({reinterpret_cast<char const*>(s.buffer_.data())
+								, std::ptrdiff_t(s.buffer_.size())}, ec);
+							emit(ts, d, event_type::extension_handshake, 0, 0, 0
+								, as_bytes(ec ? ec.message() : print_entry(e)));
+						}
+					}
 
-				std::uint32_t const extension_msg = s.buffer_[0];
+					s.handshake_.reset();
+					s.in_m_ = false;
+					s.extension_name_.clear();
+					s.buffer_.clear();
+					s.state_ = state_t::length;
+					break;
+				}
+				case state_t::bitfield:
+				{
+					buf = s.ensure_buffer(buf, s.skip_);
+					if (s.buffer_.size() < s.skip_) return verdict::keep;
 
-				s.offset_ += 1;
-				s.buffer_.clear();
-				s.skip_ -= 1;
+					emit(ts, d, event_type(5), 0, 0, 0, s.buffer_);
 
-				// this is the extension handshake. It's a bencoded structure, load
-				// it all and parse it
-				if (extension_msg == 0) {
-					s.state_ = state_t::extension_handshake;
+					s.offset_ += s.skip_;
+					s.buffer_.clear();
+					s.skip_ = 0;
+					s.state_ = state_t::length;
+					break;
 				}
-				else {
-
-					auto& other = state_[opposite(d)];
-					auto it = other.extensions_.find(extension_msg);
-					if (it == other.extensions_.end()) {
-						log_ << d << ' ' << ts << " EXTENSION-MSG: ?? (" << extension_msg << ")\n";
-					}
-					else {
-						log_ << d << ' ' << ts << " EXTENSION-MSG: " << it->second <<"\n";
+				case state_t::skip:
+				{
+					if (buf.size() == 0) return verdict::keep;
+					int const overlap = std::min(std::uint32_t(buf.size()), s.skip_);
+					s.skip_ -= overlap;
+					buf = buf.subspan(overlap);
+					s.offset_ += overlap;
+
+					emit(ts, d, event_type::payload, 0, s.skip_, std::uint32_t(overlap));
+					if (rates_ && s.in_piece_) rates_->payload(to_timestamp(ts), d, std::uint32_t(overlap));
+
+					if (s.skip_ == 0) {
+						// once we've skipped all the payload, go back to reading a
+						// length prefix
+						s.state_ = state_t::length;
 					}
-					s.state_ = state_t::skip;
+					break;
 				}
+				default:
+					assert(false);
+					return verdict::keep;
 			}
+		}
+	}
 
-			if (s.state_ == state_t::extension_handshake) {
-				buf = s.ensure_buffer(buf, s.skip_);
-				if (s.buffer_.size() < s.skip_) return;
+private:
 
-				error_code ec;
-				auto e = bdecode({reinterpret_cast<char const*>(s.buffer_.data())
-					, std::ptrdiff_t(s.buffer_.size())}, ec);
-				if (ec) {
-					log_ << d << ' ' << ts << " EXTENSION-HANDSHAKE " << ec.message() << "\n";
-				}
-				else {
-					log_ << d << ' ' << ts << " EXTENSION-HANDSHAKE " << print_entry(e) << "\n";
-					auto const m = e.dict_find_dict("m");
-					if (m) {
-						for (int i = 0; i < m.dict_size(); ++i) {
-							string_view name;
-							bdecode_node val;
-							std::tie(name, val) = m.dict_at(i);
-							if (val.type() == bdecode_node::int_t)
-								s.extensions_[val.int_value()] = std::string(name);
-						}
-					}
-				}
+	// the transport stops tracking the stream, there's no need to hold on to
+	// any buffers either
+	verdict drop()
+	{
+		disabled_ = true;
+		for (auto& side : state_) side = bittorrent_side_state();
+		rates_.reset();
+		return verdict::drop;
+	}
 
-				s.offset_ += s.skip_;
-				s.buffer_.clear();
-				s.skip_ = 0;
-				s.state_ = state_t::length;
+	// feeds the next part of the extension handshake to the incremental
+	// bdecoder, recording the extension IDs of the "m" dictionary
+	static void parse_handshake(bittorrent_side_state& s, span<unsigned char const> buf)
+	{
+		using item = libtorrent::bdecode_stream::item;
+		span<char const> in(reinterpret_cast<char const*>(buf.data()), buf.size());
+		while (!in.empty()) {
+			item it;
+			in = in.subspan(s.handshake_.next(in, it));
+			if (it.type == item::key_t && it.depth == 1) {
+				s.in_m_ = it.key == "m";
+			}
+			else if (it.type == item::key_t && it.depth == 2 && s.in_m_) {
+				// names longer than bdecode_stream::max_key only have their
+				// prefix reported. Mark them, rather than dropping them and
+				// filing the ID under the previous name
+				s.extension_name_.assign(it.key.data(), it.key.size());
+				if (it.truncated) s.extension_name_ += "...";
 			}
+			else if (it.type == item::int_t && it.depth == 2 && it.dict_value && s.in_m_) {
+				s.extensions_[int(it.value)] = s.extension_name_;
+			}
+		}
+	}
 
-			if (s.state_ == state_t::request
-				|| s.state_ == state_t::reject
-				|| s.state_ == state_t::cancel)
-			{
-				buf = s.ensure_buffer(buf, 12);
-				if (s.buffer_.size() < 12) return;
-
-				std::uint32_t const piece = read_u32(s.buffer_);
-				s.buffer_.erase(s.buffer_.begin(), s.buffer_.begin() + 4);
-				std::uint32_t const start = read_u32(s.buffer_);
-				s.buffer_.erase(s.buffer_.begin(), s.buffer_.begin() + 4);
-				std::uint32_t const length = read_u32(s.buffer_);
-
-				log_ << d << ' ' << ts;
-				switch (s.state_) {
-					case state_t::request: log_ << " REQUEST "; break;
-					case state_t::cancel: log_ << " CANCEL "; break;
-					case state_t::reject: log_ << " REJECT "; break;
-					default: assert(false);
-				}
-				log_ << piece << ' ' << start << ' ' << length << '\n';
+	// message handlers, called once the fixed size header of the message (if
+	// any) has been received. They log the message and pick the next state
 
-				s.offset_ += 12;
-				s.buffer_.clear();
-				s.skip_ -= 12;
-				check_zero(s, d);
-			}
+	void on_message(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const>)
+	{
+		emit(ts, d, event_type(s.msg_));
+		s.state_ = state_t::length;
+	}
 
-			if (s.state_ == state_t::piece) {
-				buf = s.ensure_buffer(buf, 8);
-				if (s.buffer_.size() < 8) return;
+	// CHOKE and UNCHOKE
+	void on_choke(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const>)
+	{
+		emit(ts, d, event_type(s.msg_));
+		if (requests_) {
+			if (s.msg_ == 1) requests_->unchoke(d, to_timestamp(ts));
+			else requests_->choke(d, !(state_[dir_t::in].fast_ && state_[dir_t::out].fast_)
+				, to_timestamp(ts));
+		}
+		s.state_ = state_t::length;
+	}
 
-				std::uint32_t const piece = read_u32(s.buffer_);
-				s.buffer_.erase(s.buffer_.begin(), s.buffer_.begin() + 4);
-				std::uint32_t const start = read_u32(s.buffer_);
+	// INTERESTED and NOT-INTERESTED
+	void on_interest(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const>)
+	{
+		emit(ts, d, event_type(s.msg_));
+		if (requests_) requests_->interested(d, s.msg_ == 2, to_timestamp(ts));
+		s.state_ = state_t::length;
+	}
 
-				log_ << d << ' ' << ts << " PIECE " << piece << ' ' << start << '\n';
+	void on_piece_index(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const> hdr)
+	{
+		emit(ts, d, event_type(s.msg_), read_u32(hdr));
+		s.state_ = state_t::length;
+	}
 
-				s.offset_ += 8;
-				s.buffer_.clear();
-				s.skip_ -= 8;
-				s.state_ = state_t::skip;
+	void on_block(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const> hdr)
+	{
+		std::uint32_t const piece = read_u32(hdr);
+		std::uint32_t const start = read_u32(hdr.subspan(4));
+		std::uint32_t const length = read_u32(hdr.subspan(8));
+		emit(ts, d, event_type(s.msg_), piece, start, length);
+		if (requests_) {
+			switch (s.msg_) {
+				case 6: requests_->request(d, piece, start, length, to_timestamp(ts)); break;
+				case 8: requests_->cancel(d, piece, start, to_timestamp(ts)); break;
+				case 16: requests_->reject(d, piece, start, to_timestamp(ts)); break;
 			}
+		}
+		s.state_ = state_t::length;
+	}
 
-			if (s.state_ == state_t::dht_port) {
-				buf = s.ensure_buffer(buf, 2);
-				if (s.buffer_.size() < 2) return;
+	void on_piece(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const> hdr)
+	{
+		std::uint32_t const piece = read_u32(hdr);
+		std::uint32_t const start = read_u32(hdr.subspan(4));
+		emit(ts, d, event_type(s.msg_), piece, start);
+		if (requests_) requests_->piece(d, piece, start, to_timestamp(ts));
+		s.in_piece_ = true;
+		s.state_ = s.skip_ > 0 ? state_t::skip : state_t::length;
+	}
 
-				std::uint16_t const port = read_u16(s.buffer_);
-				log_ << d << ' ' << ts << " DHT-PORT " << port <<"\n";
+	void on_dht_port(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const> hdr)
+	{
+		emit(ts, d, event_type(s.msg_), read_u16(hdr));
+		s.state_ = state_t::length;
+	}
 
-				s.offset_ += 2;
-				s.buffer_.clear();
-				s.skip_ -= 2;
-				check_zero(s, d);
-			}
+	void on_bitfield(timeval const&, dir_t, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const>)
+	{
+		s.state_ = state_t::bitfield;
+	}
 
-			if (s.state_ == state_t::bitfield) {
-				buf = s.ensure_buffer(buf, s.skip_);
-				if (s.buffer_.size() < s.skip_) return;
+	void on_extension(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const> hdr)
+	{
+		int const extension_msg = hdr[0];
 
-				log_ << d << ' ' << ts << " BITFIELD ";
-				for (auto const c : s.buffer_) {
-					log_ << std::bitset<8>(c);
-				}
-				log_ << '\n';
+		// this is the extension handshake. It's a bencoded structure, load
+		// it all and parse it
+		if (extension_msg == 0) {
+			s.state_ = state_t::extension_handshake;
+			return;
+		}
 
-				s.offset_ += s.skip_;
-				s.buffer_.clear();
-				s.skip_ = 0;
-				s.state_ = state_t::length;
-			}
+		auto& other = state_[opposite(d)];
+		auto it = other.extensions_.find(extension_msg);
+		if (it == other.extensions_.end()) {
+			emit(ts, d, event_type::extension_message, 0, std::uint32_t(extension_msg));
+		}
+		else {
+			emit(ts, d, event_type::extension_message, 1, std::uint32_t(extension_msg), 0
+				, as_bytes(it->second));
+		}
+		s.state_ = s.skip_ > 0 ? state_t::skip : state_t::length;
+	}
 
-			if (buf.size() == 0) break;
-			if (s.state_ == state_t::skip) {
-				int const overlap = std::min(std::uint32_t(buf.size()), s.skip_);
-				s.skip_ -= overlap;
-				buf = buf.subspan(overlap);
-				s.offset_ += overlap;
+	void on_unknown(timeval const& ts, dir_t const d, bittorrent_side_state& s
+		, message_descriptor const&, span<unsigned char const>)
+	{
+		emit(ts, d, event_type::unknown_message, s.msg_);
+		s.state_ = s.skip_ > 0 ? state_t::skip : state_t::length;
+	}
 
-				log_ << d << ' ' << ts << "   - payload: " << overlap << " (left: " << s.skip_ << ")\n";
+	// the dispatch table, indexed by message ID
+	static message_descriptor const& message_type(int const msg)
+	{
+		using pb = parse_bittorrent;
+		using r = size_rule;
+		static constexpr message_descriptor unknown{0, r::any, &pb::on_unknown};
+		static constexpr message_descriptor messages[] = {
+			{0, r::exact, &pb::on_choke}, // CHOKE
+			{0, r::exact, &pb::on_choke}, // UNCHOKE
+			{0, r::exact, &pb::on_interest}, // INTERESTED
+			{0, r::exact, &pb::on_interest}, // NOT-INTERESTED
+			{4, r::exact, &pb::on_piece_index}, // HAVE
+			{0, r::any, &pb::on_bitfield}, // BITFIELD
+			{12, r::exact, &pb::on_block}, // REQUEST
+			{8, r::at_least, &pb::on_piece}, // PIECE
+			{12, r::exact, &pb::on_block}, // CANCEL
+			{2, r::exact, &pb::on_dht_port}, // DHT-PORT
+			unknown,
+			unknown,
+			unknown,
+			{4, r::exact, &pb::on_piece_index}, // SUGGEST
+			{0, r::exact, &pb::on_message}, // HAVE-ALL
+			{0, r::exact, &pb::on_message}, // HAVE-NONE
+			{12, r::exact, &pb::on_block}, // REJECT
+			{4, r::exact, &pb::on_piece_index}, // ALLOWED-FAST
+			unknown,
+			unknown,
+			{1, r::at_least, &pb::on_extension}, // EXTENSION
+		};
+		if (msg >= 0 && std::size_t(msg) < sizeof(messages) / sizeof(messages[0])) return messages[msg];
+		return unknown;
+	}
 
-				if (s.skip_ == 0) {
-					// once we've skipped all the payload, go back to reading a
-					// length prefix
-					s.state_ = state_t::length;
-				}
-			}
-		}
+	// events before the info-hash is known are dropped, there's nowhere to
+	// log them yet
+	void emit(timeval const& ts, dir_t const d, event_type const t
+		, std::uint32_t const piece = 0, std::uint32_t const offset = 0
+		, std::uint32_t const length = 0, span<unsigned char const> blob = {})
+	{
+		if (!log_) return;
+		log_->write(event_record{flow_id_, to_timestamp(ts), piece, offset, length, t, d, 0}, blob);
+	}
 
-//		std::cout << "incoming " << buf.size() << " bytes\n";
+	static span<unsigned char const> as_bytes(std::string const& s)
+	{
+		return {reinterpret_cast<unsigned char const*>(s.data()), std::ptrdiff_t(s.size())};
 	}
 
-private:
 	stream_key key_;
-	std::ofstream log_;
+	std::uint64_t flow_id_;
+	event_sink* sink_;
+	flow_filter const* filter_;
+	stats_logs logs_;
+	std::unique_ptr<flow_log> log_;
+	// only set if the stats of requests are being collected, and the stream
+	// is being followed
+	std::unique_ptr<request_tracker> requests_;
+	// only set if rates are being logged
+	std::unique_ptr<rate_profile> rates_;
 	array<bittorrent_side_state, 2, dir_t> state_;
 	bool disabled_ = false;
 };
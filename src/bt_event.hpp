@@ -0,0 +1,354 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <sys/time.h>
+
+#include "stream_key.hpp"
+#include "tcp_state.hpp" // for dir_t and socket_event_t
+#include "span.hpp"
+#include "format.hpp"
+
+using libtorrent::span;
+
+// the events logged for a BitTorrent stream. Values below 64 are BitTorrent
+// message IDs, the message with that ID was received. "piece", "offset" and
+// "length" hold the fields of the message (the port, for DHT-PORT).
+enum class event_type : std::uint8_t
+{
+	handshake = 64,
+	reserved,
+	info_hash,
+	peer_id,
+	keep_alive,
+	// a length prefix larger than we expect. "length" is the prefix
+	message_too_large,
+	// the length prefix doesn't match the message type. "piece" is the message
+	// ID and "length" the size of the message (excluding the ID)
+	invalid_size,
+	// "piece" is the message ID
+	unknown_message,
+	extension_handshake,
+	// "offset" is the extension message ID. "piece" is 1 if the blob holds its
+	// name, 0 if the name isn't known
+	extension_message,
+	// "length" bytes of a message body were skipped, "offset" bytes are left
+	payload,
+	ack,
+	// transport layer events, in the same order as socket_event_t
+	reset,
+	fin,
+	seqnr_mismatch,
+	timeout,
+	// "length" is the reorder depth
+	reorder_depth,
+};
+
+// a fixed size record of a single event. Events carrying variable length data
+// (the bitfield, handshake fields and extension handshake) are followed by
+// "blob_records" records holding "length" bytes of it.
+struct event_record
+{
+	std::uint64_t flow_id;
+	// microseconds since the epoch
+	std::int64_t timestamp;
+	std::uint32_t piece;
+	std::uint32_t offset;
+	std::uint32_t length;
+	event_type type;
+	dir_t dir;
+	std::uint16_t blob_records;
+};
+
+static_assert(sizeof(event_record) == 32, "event_record is expected to be 32 bytes");
+
+inline event_type to_event(socket_event_t const e)
+{
+	return event_type(std::uint8_t(event_type::reset) + std::uint8_t(e));
+}
+
+constexpr std::size_t max_blob_size = 0xffff * sizeof(event_record);
+
+inline std::int64_t to_timestamp(timeval const& ts)
+{
+	return std::int64_t(ts.tv_sec) * 1000000 + ts.tv_usec;
+}
+
+inline timeval to_timeval(std::int64_t const ts)
+{
+	timeval ret{};
+	ret.tv_sec = time_t(ts / 1000000);
+	ret.tv_usec = suseconds_t(ts % 1000000);
+	return ret;
+}
+
+// the name a message is logged with
+inline char const* message_name(int const msg)
+{
+	static constexpr std::array<char const*, 21> names = {{"CHOKE", "UNCHOKE"
+		, "INTERESTED", "NOT-INTERESTED", "HAVE", "BITFIELD", "REQUEST", "PIECE"
+		, "CANCEL", "DHT-PORT", "??", "??", "??", "SUGGEST", "HAVE-ALL", "HAVE-NONE"
+		, "REJECT", "ALLOWED-FAST", "??", "??", "EXTENSION"}};
+	if (msg >= 0 && std::size_t(msg) < names.size()) return names[std::size_t(msg)];
+	return "??";
+}
+
+// the name an unknown message is logged with
+inline void append_msg_type_name(text_buffer& out, int const msg)
+{
+	static constexpr std::array<char const*, 21> names = {{"choke", "unchoke", "interested", "not_interested"
+		, "have", "bitfield", "request", "piece", "cancel", "dht_port", "??", "??", "??"
+		, "suggest_piece", "have_all", "have_none", "reject_request", "allowed_fast", "??", "??", "extension-msg"}};
+
+	if (msg >= 0 && static_cast<std::size_t>(msg) < names.size()) {
+		append(out, names[std::size_t(msg)]);
+		return;
+	}
+	append(out, "?? (");
+	append_int(out, msg);
+	append(out, ')');
+}
+
+// the information about a flow an event log is opened with
+struct flow_info
+{
+	std::uint64_t flow_id;
+	std::array<unsigned char, 20> info_hash;
+	stream_key key;
+};
+
+inline std::string info_hash_str(std::array<unsigned char, 20> const& ih)
+{
+	text_buffer ret;
+	append_hex(ret, ih);
+	return std::string(ret.begin(), ret.end());
+}
+
+// the path of the text log of a flow, relative to the output directory
+inline std::string flow_log_path(flow_info const& f)
+{
+	// the flow ID makes the filename unique, even if the same endpoints are
+	// re-used for another connection
+	text_buffer ret;
+	append(ret, "bt/");
+	append_hex(ret, f.info_hash);
+	append(ret, '/');
+	append_address(ret, f.key.src);
+	append(ret, '.');
+	append_int(ret, f.key.src_port);
+	append(ret, '_');
+	append_address(ret, f.key.dst);
+	append(ret, '.');
+	append_int(ret, f.key.dst_port);
+	append(ret, '_');
+	append_int(ret, f.flow_id);
+	return std::string(ret.begin(), ret.end());
+}
+
+// how BITFIELD messages are logged
+enum class bitfield_format : std::uint8_t
+{
+	// every bit, as '0' or '1'
+	full,
+	// the number of bits set, e.g. "have 1000/1024". The total includes the
+	// padding bits of the last byte
+	summary,
+	// the summary followed by runs of equal bits, e.g.
+	// "have 1000/1024: 1x1000 0x24"
+	runs
+};
+
+// returns false if "name" isn't one of "full", "summary" or "runs"
+inline bool parse_bitfield_format(std::string_view const name, bitfield_format& f)
+{
+	if (name == "full") f = bitfield_format::full;
+	else if (name == "summary") f = bitfield_format::summary;
+	else if (name == "runs") f = bitfield_format::runs;
+	else return false;
+	return true;
+}
+
+struct format_options
+{
+	bitfield_format bitfield = bitfield_format::full;
+};
+
+inline void append_dir(text_buffer& out, dir_t const d)
+{
+	switch (d) {
+		case dir_t::in: append(out, "\x1b[34m<<"); return;
+		case dir_t::out: append(out, "\x1b[33m>>"); return;
+	}
+	append(out, "??");
+}
+
+// appends an event as a line of the text log
+inline void format_event(text_buffer& out, event_record const& e, span<unsigned char const> blob
+	, format_options const& opts = {})
+{
+	if (e.type == event_type::reorder_depth) {
+		append_dir(out, e.dir);
+		append(out, " (transport layer: max reorder depth: ");
+		append_int(out, e.length);
+		append(out, ")\n");
+		return;
+	}
+
+	append_dir(out, e.dir);
+	append(out, ' ');
+	append_timestamp(out, to_timeval(e.timestamp));
+	append(out, ' ');
+
+	if (std::uint8_t(e.type) < 64) {
+		int const msg = int(e.type);
+		append(out, message_name(msg));
+		switch (msg) {
+			case 4: case 9: case 13: case 17:
+				append(out, ' ');
+				append_int(out, e.piece);
+				break;
+			case 5:
+				append(out, ' ');
+				if (opts.bitfield == bitfield_format::full) {
+					append_bits(out, blob);
+					break;
+				}
+				append(out, "have ");
+				append_int(out, popcount(blob));
+				append(out, '/');
+				append_int(out, std::uint64_t(blob.size()) * 8);
+				if (opts.bitfield == bitfield_format::runs) {
+					append(out, ": ");
+					append_bit_runs(out, blob);
+				}
+				break;
+			case 6: case 8: case 16:
+				append(out, ' ');
+				append_int(out, e.piece);
+				append(out, ' ');
+				append_int(out, e.offset);
+				append(out, ' ');
+				append_int(out, e.length);
+				break;
+			case 7:
+				append(out, ' ');
+				append_int(out, e.piece);
+				append(out, ' ');
+				append_int(out, e.offset);
+				break;
+			default: break;
+		}
+		append(out, '\n');
+		return;
+	}
+
+	auto const text = [](span<unsigned char const> b)
+	{ return std::string_view(reinterpret_cast<char const*>(b.data()), std::size_t(b.size())); };
+
+	switch (e.type) {
+		case event_type::handshake: append(out, "HANDSHAKE"); break;
+		case event_type::reserved:
+			append(out, "RESERVED ");
+			append_hex(out, blob);
+			break;
+		case event_type::info_hash:
+			append(out, "INFO-HASH ");
+			append_hex(out, blob);
+			break;
+		case event_type::peer_id:
+			append(out, "PEER-ID ");
+			append_hex(out, blob);
+			append(out, " [");
+			append_printable(out, blob);
+			append(out, ']');
+			break;
+		case event_type::keep_alive: append(out, "KEEP-ALIVE"); break;
+		case event_type::message_too_large:
+			append(out, "ERROR: message too large! ");
+			append_int(out, e.length);
+			append(out, " (");
+			append_int(out, e.length, 16);
+			append(out, ')');
+			break;
+		case event_type::invalid_size:
+			append(out, "ERROR: invalid ");
+			append(out, message_name(int(e.piece)));
+			append(out, " message size: ");
+			append_int(out, e.length);
+			break;
+		case event_type::unknown_message:
+			append(out, "msg: ");
+			append_msg_type_name(out, int(e.piece));
+			break;
+		case event_type::extension_handshake:
+			append(out, "EXTENSION-HANDSHAKE ");
+			append(out, text(blob));
+			break;
+		case event_type::extension_message:
+			append(out, "EXTENSION-MSG: ");
+			if (e.piece) {
+				append(out, text(blob));
+			}
+			else {
+				append(out, "?? (");
+				append_int(out, e.offset);
+				append(out, ')');
+			}
+			break;
+		case event_type::payload:
+			append(out, "  - payload: ");
+			append_int(out, e.length);
+			append(out, " (left: ");
+			append_int(out, e.offset);
+			append(out, ')');
+			break;
+		case event_type::ack: append(out, "ACK"); break;
+		case event_type::reset:
+		case event_type::fin:
+		case event_type::seqnr_mismatch:
+		case event_type::timeout:
+			append(out, socket_event_name(socket_event_t(std::uint8_t(e.type) - std::uint8_t(event_type::reset))));
+			break;
+		default:
+			append(out, "?? (");
+			append_int(out, int(e.type));
+			append(out, ')');
+			break;
+	}
+	append(out, '\n');
+}
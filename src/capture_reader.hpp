@@ -0,0 +1,379 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "pcap.hpp"
+#include "mapped_file.hpp"
+#include "span.hpp"
+#include "str.hpp"
+
+using libtorrent::span;
+
+struct capture_stats
+{
+	std::uint64_t records = 0;
+	std::uint64_t bytes = 0;
+	double seconds = 0.0;
+	// true if the file was read through the memory mapped reader, false if we
+	// fell back to libpcap
+	bool mapped = false;
+
+	friend std::ostream& operator<<(std::ostream& os, capture_stats const& s)
+	{
+		double const secs = std::max(s.seconds, 1e-9);
+		return os << "read " << s.records << " records ("
+			<< std::fixed << std::setprecision(2) << s.bytes / 1e9 << " GB) in "
+			<< s.seconds << " s: " << std::setprecision(0) << s.records / secs << " records/s, "
+			<< std::setprecision(2) << s.bytes / 1e9 / secs << " GB/s"
+			<< (s.mapped ? " (mmap)" : " (libpcap)") << std::defaultfloat;
+	}
+};
+
+namespace aux {
+
+	// all fields in pcap and pcapng files are in the byte order of the machine
+	// that wrote them. "swap" is true when that's different from ours
+	inline std::uint16_t load16(unsigned char const* p, bool const swap)
+	{
+		std::uint16_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return swap ? std::uint16_t(__builtin_bswap16(v)) : v;
+	}
+
+	inline std::uint32_t load32(unsigned char const* p, bool const swap)
+	{
+		std::uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return swap ? __builtin_bswap32(v) : v;
+	}
+
+	inline std::uint64_t load64(unsigned char const* p, bool const swap)
+	{
+		std::uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return swap ? __builtin_bswap64(v) : v;
+	}
+
+	// convert a timestamp in "units_per_sec" units since the epoch to a timeval
+	inline timeval make_timeval(std::uint64_t const ts, std::uint64_t const units_per_sec)
+	{
+		timeval ret;
+		ret.tv_sec = time_t(ts / units_per_sec);
+		ret.tv_usec = suseconds_t(static_cast<unsigned __int128>(ts % units_per_sec)
+			* 1000000 / units_per_sec);
+		return ret;
+	}
+
+	// once we're this far past a region of the file, we drop it from our
+	// mapping. This keeps 200 GB captures from evicting everything else from the
+	// page cache, while giving consumers of the spans plenty of slack
+	std::size_t const release_lag = std::size_t(1) << 30;
+
+	// the signature of the record handler is:
+	// void(timeval const& ts, span<unsigned char const> pkt, std::uint32_t orig_len)
+
+	// walk a classic pcap file. Returns false if this isn't one
+	template <typename Fun>
+	bool read_pcap(mapped_file& f, Fun& fun, capture_stats& st)
+	{
+		span<unsigned char const> buf = f.data();
+		if (buf.size() < 24) return false;
+
+		std::uint32_t magic;
+		std::memcpy(&magic, buf.data(), 4);
+		bool swap = false;
+		std::uint64_t units_per_sec = 1000000;
+		switch (magic) {
+			case 0xa1b2c3d4: break;
+			case 0xd4c3b2a1: swap = true; break;
+			case 0xa1b23c4d: units_per_sec = 1000000000; break;
+			case 0x4d3cb2a1: swap = true; units_per_sec = 1000000000; break;
+			default: return false;
+		}
+
+		std::size_t offset = 24;
+		while (buf.size() - std::ptrdiff_t(offset) >= 16) {
+			unsigned char const* hdr = buf.data() + offset;
+			std::uint32_t const caplen = load32(hdr + 8, swap);
+			std::uint32_t const len = load32(hdr + 12, swap);
+			if (std::size_t(buf.size()) - offset - 16 < caplen) {
+				std::cerr << "truncated record at offset " << offset << '\n';
+				break;
+			}
+
+			timeval ts;
+			ts.tv_sec = time_t(load32(hdr, swap));
+			ts.tv_usec = suseconds_t(std::uint64_t(load32(hdr + 4, swap)) * 1000000 / units_per_sec);
+
+			fun(ts, span<unsigned char const>(hdr + 16, caplen), len);
+			++st.records;
+			st.bytes += caplen;
+			offset += 16 + caplen;
+			if (offset > release_lag) f.release(offset - release_lag);
+		}
+		return true;
+	}
+
+	// walk a pcapng file. Returns false if this isn't one
+	template <typename Fun>
+	bool read_pcapng(mapped_file& f, Fun& fun, capture_stats& st)
+	{
+		span<unsigned char const> buf = f.data();
+		if (buf.size() < 28) return false;
+
+		std::uint32_t const shb_type = 0x0A0D0D0A;
+		std::uint32_t const byte_order_magic = 0x1A2B3C4D;
+		if (load32(buf.data(), false) != shb_type) return false;
+
+		bool swap = false;
+		// the timestamp resolution and offset for each interface in the current
+		// section, in order of their interface description blocks
+		struct interface_t { std::uint64_t units_per_sec; std::int64_t offset; std::uint32_t snaplen; };
+		std::vector<interface_t> interfaces;
+		timeval last_ts{0, 0};
+
+		std::size_t offset = 0;
+		while (buf.size() - std::ptrdiff_t(offset) >= 12) {
+			unsigned char const* blk = buf.data() + offset;
+			std::uint32_t const type = load32(blk, swap);
+
+			// the section header block is the only one whose byte order we
+			// can't know up-front. It's given by the magic following the length
+			if (type == shb_type) {
+				std::uint32_t const magic = load32(blk + 8, false);
+				if (magic == byte_order_magic) swap = false;
+				else if (magic == __builtin_bswap32(byte_order_magic)) swap = true;
+				else throw std::runtime_error(str("invalid pcapng section header at offset ", offset));
+				interfaces.clear();
+			}
+
+			std::uint32_t const blk_len = load32(blk + 4, swap);
+			if (blk_len < 12 || (blk_len & 3) != 0 || std::size_t(buf.size()) - offset < blk_len) {
+				std::cerr << "truncated block at offset " << offset << '\n';
+				break;
+			}
+			span<unsigned char const> body(blk + 8, blk_len - 12);
+
+			switch (type) {
+				case 1: // interface description block
+				{
+					if (body.size() < 8) break;
+					interface_t iface{1000000, 0, load32(body.data() + 4, swap)};
+					// walk the options, looking for if_tsresol and if_tsoffset
+					span<unsigned char const> opt = body.subspan(8);
+					while (opt.size() >= 4) {
+						std::uint16_t const code = load16(opt.data(), swap);
+						std::uint16_t const len = load16(opt.data() + 2, swap);
+						if (code == 0 || opt.size() < 4 + len) break;
+						if (code == 9 && len >= 1) {
+							std::uint8_t const res = opt[4];
+							std::uint64_t units = 1;
+							if (res & 0x80) units <<= std::min(res & 0x7f, 63);
+							else for (int i = 0; i < std::min(int(res), 19); ++i) units *= 10;
+							iface.units_per_sec = units;
+						}
+						else if (code == 14 && len >= 8) {
+							iface.offset = std::int64_t(load64(opt.data() + 4, swap));
+						}
+						opt = opt.subspan(std::min(opt.size(), std::ptrdiff_t(4 + ((len + 3) & ~3))));
+					}
+					interfaces.push_back(iface);
+					break;
+				}
+				case 2: // obsolete packet block
+				case 6: // enhanced packet block
+				{
+					if (body.size() < 20) break;
+					std::uint32_t const iface_id = (type == 2)
+						? load16(body.data(), swap) : load32(body.data(), swap);
+					if (iface_id >= interfaces.size()) {
+						throw std::runtime_error(str("pcapng packet refers to unknown interface "
+							, iface_id, " at offset ", offset));
+					}
+					auto const& iface = interfaces[iface_id];
+					std::uint64_t const ts = (std::uint64_t(load32(body.data() + 4, swap)) << 32)
+						| load32(body.data() + 8, swap);
+					std::uint32_t const caplen = load32(body.data() + 12, swap);
+					std::uint32_t const len = load32(body.data() + 16, swap);
+					if (body.size() - 20 < caplen) {
+						throw std::runtime_error(str("invalid pcapng packet length at offset ", offset));
+					}
+
+					last_ts = make_timeval(ts, iface.units_per_sec);
+					last_ts.tv_sec += time_t(iface.offset);
+					fun(last_ts, body.subspan(20, caplen), len);
+					++st.records;
+					st.bytes += caplen;
+					break;
+				}
+				case 3: // simple packet block
+				{
+					if (body.size() < 4 || interfaces.empty()) break;
+					std::uint32_t const len = load32(body.data(), swap);
+					std::uint32_t caplen = std::min(len, std::uint32_t(body.size() - 4));
+					if (interfaces[0].snaplen != 0) caplen = std::min(caplen, interfaces[0].snaplen);
+
+					// simple packet blocks don't have timestamps. The best we can
+					// do is to use the one from the previous packet
+					fun(last_ts, body.subspan(4, caplen), len);
+					++st.records;
+					st.bytes += caplen;
+					break;
+				}
+				default:
+					// statistics, name resolution, custom blocks etc.
+					break;
+			}
+
+			offset += blk_len;
+			if (offset > release_lag) f.release(offset - release_lag);
+		}
+		return true;
+	}
+
+	template <typename Fun>
+	void pcap_loop_trampoline(u_char* user_data, pcap_pkthdr const* pkthdr, u_char const* packet)
+	{
+		auto& fun = *reinterpret_cast<Fun*>(user_data);
+		fun(pkthdr->ts, span<unsigned char const>(packet, pkthdr->caplen), pkthdr->len);
+	}
+}
+
+// reads records from a capture file. pcap and pcapng files are memory mapped
+// and parsed directly, the packet spans point straight into the mapping and
+// remain valid for the lifetime of the capture_reader. Any other format is
+// handed to libpcap, in which case the span is only valid for the duration of
+// the call.
+struct capture_reader
+{
+	explicit capture_reader(char const* filename)
+		: m_filename(filename)
+		, m_file(filename)
+	{
+		if (!m_file.is_open()) return;
+		span<unsigned char const> const buf = m_file.data();
+		if (buf.size() < 4) return;
+		switch (aux::load32(buf.data(), false)) {
+			case 0xa1b2c3d4:
+			case 0xd4c3b2a1:
+			case 0xa1b23c4d:
+			case 0x4d3cb2a1:
+				m_format = format_t::pcap;
+				break;
+			case 0x0A0D0D0A:
+				m_format = format_t::pcapng;
+				break;
+		}
+	}
+
+	// returns true if packet spans outlive the call to the handler
+	bool mapped() const { return m_format != format_t::libpcap; }
+
+	// calls "fun" with the timestamp and captured bytes of every record in the
+	// file. The signature of fun is:
+	//
+	// void(timeval const& ts, span<unsigned char const> pkt)
+	template <typename Fun>
+	capture_stats read(Fun&& fun)
+	{
+		capture_stats st;
+		auto const start = std::chrono::steady_clock::now();
+
+		auto handler = [&fun](timeval const& ts, span<unsigned char const> pkt, std::uint32_t const len)
+		{
+			if (len != pkt.size()) {
+				std::cout << " ERROR: missing data in capture! packet: " << len << " B captured: " << pkt.size() << "B\n";
+			}
+			fun(ts, pkt);
+		};
+
+		switch (m_format) {
+			case format_t::pcap:
+				aux::read_pcap(m_file, handler, st);
+				st.mapped = true;
+				break;
+			case format_t::pcapng:
+				aux::read_pcapng(m_file, handler, st);
+				st.mapped = true;
+				break;
+			case format_t::libpcap:
+			{
+				// fall back to libpcap for formats we don't understand, or files
+				// we can't map (like stdin)
+				auto counting_handler = [&](timeval const& ts, span<unsigned char const> pkt, std::uint32_t const len)
+				{
+					++st.records;
+					st.bytes += std::uint64_t(pkt.size());
+					handler(ts, pkt, len);
+				};
+				pcap_handle h = pcap_open(m_filename.c_str());
+				if (pcap_loop(h, 0, &aux::pcap_loop_trampoline<decltype(counting_handler)>
+					, reinterpret_cast<unsigned char*>(&counting_handler)) < 0) {
+					throw std::runtime_error(str("pcap_loop() failed: ", pcap_geterr(h)));
+				}
+				break;
+			}
+		}
+
+		st.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return st;
+	}
+
+private:
+	enum class format_t : std::uint8_t { libpcap, pcap, pcapng };
+
+	std::string m_filename;
+	mapped_file m_file;
+	format_t m_format = format_t::libpcap;
+};
+
+// convenience function to read all records from "filename", see
+// capture_reader::read()
+template <typename Fun>
+capture_stats read_capture(char const* filename, Fun&& fun)
+{
+	capture_reader r(filename);
+	return r.read(std::forward<Fun>(fun));
+}
@@ -0,0 +1,123 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <iostream>
+#include <string>
+
+#include "binary_log.hpp"
+#include "event_sink.hpp"
+#include "flow_filter.hpp"
+
+int print_usage()
+{
+	std::cout << R"(tracebt-dump [OPTIONS] binary-log
+
+Converts a binary event log, written by tracebt --binary-log, to the text
+format. Streams are written to files under bt/, like tracebt does.
+
+OPTIONS:
+--help              print this message
+--info-hash <hex>   only convert the streams of this torrent. May be given more
+                    than once.
+--bitfield <format> How to log BITFIELD messages. "full" logs every bit,
+                    "summary" the number of pieces the peer has and "runs" the
+                    summary followed by runs of equal bits. Defaults to full.
+)";
+	return 1;
+}
+
+int main(int argc, char const* argv[]) try
+{
+	if (argc == 1) {
+		return print_usage();
+	}
+
+	++argv;
+	--argc;
+
+	using namespace std::literals::string_literals;
+
+	flow_filter filter;
+	format_options opts;
+
+	while (argc > 1) {
+		if (argv[0] == "--help"s) {
+			print_usage();
+			return 0;
+		}
+		if (argv[0] == "--info-hash"s && argc > 2) {
+			if (!filter.add_info_hash(argv[1])) {
+				std::cerr << "invalid info-hash: " << argv[1] << '\n';
+				return 1;
+			}
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--bitfield"s && argc > 2) {
+			if (!parse_bitfield_format(argv[1], opts.bitfield)) {
+				std::cerr << "unknown bitfield format: " << argv[1] << '\n';
+				return 1;
+			}
+			++argv;
+			--argc;
+		}
+		else {
+			std::cerr << "unknown option: " << argv[0] << '\n';
+			return 1;
+		}
+
+		++argv;
+		--argc;
+	}
+
+	binary_log_reader const log(argv[0]);
+	async_writer writer;
+	text_sink sink(writer, opts);
+
+	std::uint64_t flows = 0;
+	std::uint64_t events = 0;
+	for (auto const& ih : log.info_hashes()) {
+		if (!filter.match_info_hash(ih.info_hash)) continue;
+		events += replay(log, ih, sink);
+		flows += log.flows(ih).size();
+	}
+
+	writer.close();
+	std::cerr << "wrote " << events << " events of " << flows << " streams\n"
+		<< writer.stats() << '\n';
+	return 0;
+}
+catch (std::exception const& e)
+{
+	std::cerr << "failed: " << e.what() << '\n';
+	return 1;
+}
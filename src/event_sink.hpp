@@ -0,0 +1,123 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <memory>
+
+#include <sys/stat.h>
+
+#include "bt_event.hpp"
+#include "async_writer.hpp"
+#include "format.hpp"
+
+// receives the events of a single BitTorrent stream, in order
+struct flow_log
+{
+	// "e.blob_records" is filled in by the log, if it stores the blob that way
+	virtual void write(event_record const& e, span<unsigned char const> blob) = 0;
+	virtual ~flow_log() = default;
+};
+
+// where the event logs of streams go. A stream's log is opened once its
+// info-hash is known. open_flow() may be called from multiple threads at once,
+// a flow_log is only ever used by one thread.
+struct event_sink
+{
+	virtual std::unique_ptr<flow_log> open_flow(flow_info const& f) = 0;
+	virtual ~event_sink() = default;
+};
+
+// the human readable format. Every stream is logged to its own file, named by
+// flow_log_path(). Lines are formatted into a buffer per stream, which is
+// handed to the writer as it fills up
+struct text_sink final : event_sink
+{
+	explicit text_sink(async_writer& w, format_options const& opts = {})
+		: m_writer(w)
+		, m_opts(opts)
+	{}
+
+	std::unique_ptr<flow_log> open_flow(flow_info const& f) override
+	{
+		// these may race with other threads creating the same directories.
+		// That's fine, mkdir() is atomic and the loser just gets EEXIST
+		mkdir("bt", 0755);
+		mkdir(("bt/" + info_hash_str(f.info_hash)).c_str(), 0755);
+		return std::make_unique<text_log>(m_writer, m_writer.add_file(flow_log_path(f)), m_opts);
+	}
+
+private:
+
+	struct text_log final : flow_log
+	{
+		text_log(async_writer& w, std::uint32_t const file, format_options const& opts)
+			: m_writer(w)
+			, m_file(file)
+			, m_opts(opts)
+		{}
+
+		void write(event_record const& e, span<unsigned char const> blob) override
+		{
+			format_event(m_buf, e, blob, m_opts);
+			if (m_buf.size() >= flush_size) flush();
+		}
+
+		~text_log()
+		{
+			// the file is created even if nothing was logged
+			if (!m_buf.empty() || !m_written) flush();
+		}
+
+	private:
+
+		static constexpr std::size_t flush_size = 16 * 1024;
+
+		void flush()
+		{
+			m_writer.write(m_file, async_writer::append, m_buf);
+			// the buffer we get back is not kept, to not have idle streams
+			// hold on to it
+			text_buffer().swap(m_buf);
+			m_written = true;
+		}
+
+		async_writer& m_writer;
+		std::uint32_t m_file;
+		format_options m_opts;
+		text_buffer m_buf;
+		bool m_written = false;
+	};
+
+	async_writer& m_writer;
+	format_options m_opts;
+};
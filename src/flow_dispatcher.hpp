@@ -0,0 +1,197 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+
+#include "capture_reader.hpp"
+#include "spsc_queue.hpp"
+#include "cast.hpp"
+#include "span.hpp"
+
+using libtorrent::span;
+
+struct packet_slot
+{
+	timeval ts;
+	span<unsigned char const> pkt;
+	// the index of this record in the capture file
+	std::uint64_t index = 0;
+	// if the capture reader doesn't keep packets alive beyond the callback, the
+	// packet is copied into here
+	std::vector<unsigned char> storage;
+};
+
+// returns which of "num_workers" workers should own this packet. The choice
+// only depends on the (unordered) pair of IP addresses, which means both
+// directions of a flow end up on the same worker. Ports are deliberately not
+// included, since only the first fragment of a fragmented IP packet carries
+// them, and all fragments must be reassembled by the worker owning the flow.
+// Anything we can't make sense of goes to worker 0, to be dealt with (or
+// reported) by its processor.
+inline int shard_packet(span<unsigned char const> pkt, int const num_workers)
+{
+	if (pkt.size() < std::ptrdiff_t(sizeof(ether_header) + sizeof(ip))) return 0;
+	auto const& eth_header = cast<ether_header const>(pkt);
+	if (ntohs(eth_header.ether_type) != ETHERTYPE_IP) return 0;
+	auto const& ip_header = cast<ip const>(pkt.subspan(sizeof(ether_header)));
+
+	std::uint32_t const src = ip_header.ip_src.s_addr;
+	std::uint32_t const dst = ip_header.ip_dst.s_addr;
+	std::uint64_t const key = (std::uint64_t(std::min(src, dst)) << 32) | std::max(src, dst);
+	return int(((key * 0x9e3779b97f4a7c15ull) >> 32) % std::uint64_t(num_workers));
+}
+
+// reads packets from "reader" on the calling thread and fans them out to
+// "num_threads" worker threads, each running its own Processor. Each flow is
+// owned by exactly one worker and its packets are delivered to it in capture
+// order. Processors are constructed from "args" and must have the member
+// functions:
+//
+// void process(timeval const& ts, span<unsigned char const> pkt, std::uint64_t index)
+// void advance(timeval const& ts)
+//
+// Once a worker has processed its last packet, its processor is advanced to the
+// latest timestamp in the capture, since it may not have seen it itself. Then
+// finish(Processor&) is called, on the worker thread, before the processor is
+// destroyed. Calls to finish() may run concurrently.
+//
+// If any processor throws, the first exception is re-thrown once all workers
+// have been joined.
+template <typename Processor, typename Finish, typename... Args>
+capture_stats process_parallel(capture_reader& reader, int const num_threads
+	, Finish const& finish, Args const&... args)
+{
+	struct worker
+	{
+		explicit worker(Args const&... args) : proc(new Processor(args...)) {}
+		spsc_queue<packet_slot> queue{4096};
+		std::unique_ptr<Processor> proc;
+		std::exception_ptr error;
+		std::thread thread;
+	};
+
+	std::atomic<bool> done{false};
+	// the latest timestamp in the capture. Written before "done" is set
+	timeval last{};
+	std::vector<std::unique_ptr<worker>> workers;
+	for (int i = 0; i < num_threads; ++i) {
+		workers.emplace_back(new worker(args...));
+	}
+
+	auto const start = std::chrono::steady_clock::now();
+
+	for (auto& wp : workers) {
+		wp->thread = std::thread([&w = *wp, &done, &last, &finish]()
+		{
+			int idle = 0;
+			for (;;) {
+				packet_slot* s = w.queue.front();
+				if (s == nullptr) {
+					// "done" is set after the last packet is pushed, so we need to
+					// look at the queue one more time once we've seen it
+					if (done.load(std::memory_order_acquire) && w.queue.front() == nullptr) break;
+					if (++idle < 64) continue;
+					if (idle < 1024) std::this_thread::yield();
+					else std::this_thread::sleep_for(std::chrono::microseconds(50));
+					continue;
+				}
+				idle = 0;
+				// once a processor has failed, keep draining the queue to not
+				// block the reader
+				if (!w.error) {
+					try { w.proc->process(s->ts, s->pkt, s->index); }
+					catch (...) { w.error = std::current_exception(); }
+				}
+				w.queue.pop();
+			}
+			if (!w.error) {
+				try {
+					w.proc->advance(last);
+					finish(*w.proc);
+				}
+				catch (...) { w.error = std::current_exception(); }
+			}
+			// tear down the processor (and close all its files) on this thread
+			w.proc.reset();
+		});
+	}
+
+	bool const copy = !reader.mapped();
+	std::uint64_t index = 0;
+	capture_stats st;
+	try {
+		st = reader.read([&](timeval const& ts, span<unsigned char const> pkt)
+		{
+			auto& w = *workers[std::size_t(shard_packet(pkt, num_threads))];
+			packet_slot* s;
+			while ((s = w.queue.back()) == nullptr) std::this_thread::yield();
+			s->ts = ts;
+			s->index = index++;
+			if (ts.tv_sec > last.tv_sec) last = ts;
+			if (copy) {
+				s->storage.assign(pkt.begin(), pkt.end());
+				s->pkt = s->storage;
+			}
+			else {
+				s->pkt = pkt;
+			}
+			w.queue.push();
+		});
+	}
+	catch (...) {
+		done.store(true, std::memory_order_release);
+		for (auto& w : workers) w->thread.join();
+		throw;
+	}
+
+	done.store(true, std::memory_order_release);
+	for (auto& w : workers) w->thread.join();
+	for (auto& w : workers) {
+		if (w->error) std::rethrow_exception(w->error);
+	}
+
+	st.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return st;
+}
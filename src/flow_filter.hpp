@@ -0,0 +1,128 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "span.hpp"
+
+using libtorrent::span;
+
+// selects the flows to follow. Flows can be picked by the address of either
+// endpoint (checked when the flow is opened) and by the info-hash of its
+// torrent (checked as soon as the handshake has it). An empty list matches
+// everything.
+struct flow_filter
+{
+	using info_hash_t = std::array<unsigned char, 20>;
+
+	// parses "a.b.c.d/n" or a single address. Returns false if it's invalid
+	bool add_peer(std::string const& cidr)
+	{
+		auto const slash = cidr.find('/');
+		int bits = 32;
+		if (slash != std::string::npos) {
+			char* end;
+			bits = int(std::strtol(cidr.c_str() + slash + 1, &end, 10));
+			if (*end != '\0' || end == cidr.c_str() + slash + 1 || bits < 0 || bits > 32)
+				return false;
+		}
+		in_addr a;
+		if (inet_pton(AF_INET, cidr.substr(0, slash).c_str(), &a) != 1) return false;
+		std::uint32_t const mask = bits == 0 ? 0 : ~std::uint32_t(0) << (32 - bits);
+		m_peers.push_back(subnet{ntohl(a.s_addr) & mask, mask});
+		return true;
+	}
+
+	// parses 40 hex digits. Returns false if it's invalid
+	bool add_info_hash(std::string const& hex)
+	{
+		if (hex.size() != 40) return false;
+		info_hash_t ih;
+		for (std::size_t i = 0; i < ih.size(); ++i) {
+			int const hi = hex_value(hex[i * 2]);
+			int const lo = hex_value(hex[i * 2 + 1]);
+			if (hi < 0 || lo < 0) return false;
+			ih[i] = static_cast<unsigned char>((hi << 4) | lo);
+		}
+		m_info_hashes.insert(std::upper_bound(m_info_hashes.begin(), m_info_hashes.end(), ih), ih);
+		return true;
+	}
+
+	// addresses are in host byte order
+	bool match_peers(std::uint32_t const a, std::uint32_t const b) const
+	{
+		if (m_peers.empty()) return true;
+		for (auto const& s : m_peers) {
+			if ((a & s.mask) == s.addr || (b & s.mask) == s.addr) return true;
+		}
+		return false;
+	}
+
+	bool match_info_hash(span<unsigned char const> ih) const
+	{
+		if (m_info_hashes.empty()) return true;
+		if (ih.size() != 20) return false;
+		info_hash_t key;
+		std::memcpy(key.data(), ih.data(), key.size());
+		return std::binary_search(m_info_hashes.begin(), m_info_hashes.end(), key);
+	}
+
+private:
+
+	static int hex_value(char const c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	struct subnet
+	{
+		std::uint32_t addr;
+		std::uint32_t mask;
+	};
+
+	std::vector<subnet> m_peers;
+	// sorted
+	std::vector<info_hash_t> m_info_hashes;
+};
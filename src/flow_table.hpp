@@ -0,0 +1,223 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// a pair of IPv4 endpoints packed into 12 bytes, independent of the direction
+// of the packet it was built from. The lower endpoint (by address, then port)
+// is always stored first.
+struct flow_key
+{
+	std::uint32_t addr[2];
+	std::uint16_t port[2];
+
+	friend bool operator==(flow_key const& lhs, flow_key const& rhs)
+	{
+		return std::memcmp(&lhs, &rhs, sizeof(flow_key)) == 0;
+	}
+};
+
+static_assert(sizeof(flow_key) == 12, "flow_key is expected to be packed");
+
+struct canonical_key
+{
+	flow_key key;
+	// true if the sender of the packet is the second endpoint in key
+	bool swapped;
+};
+
+// addresses and ports are in host byte order
+inline canonical_key make_flow_key(std::uint32_t const src, std::uint16_t const src_port
+	, std::uint32_t const dst, std::uint16_t const dst_port)
+{
+	bool const swapped = std::make_pair(src, src_port) > std::make_pair(dst, dst_port);
+	if (swapped) return {{{dst, src}, {dst_port, src_port}}, true};
+	return {{{src, dst}, {src_port, dst_port}}, false};
+}
+
+inline std::uint32_t hash_flow_key(flow_key const& k)
+{
+	std::uint64_t a;
+	std::uint32_t b;
+	std::memcpy(&a, &k.addr, sizeof(a));
+	std::memcpy(&b, &k.port, sizeof(b));
+	std::uint64_t h = (a ^ (std::uint64_t(b) << 17)) * 0x9e3779b97f4a7c15ull;
+	h ^= (h >> 29) ^ (std::uint64_t(b) * 0xc2b2ae3d27d4eb4full);
+	h *= 0xbf58476d1ce4e5b9ull;
+	return std::uint32_t(h >> 32);
+}
+
+// a flow stored in a flow_table. Since the key doesn't say which endpoint
+// opened the flow, that's recorded here, to tell the direction of packets
+template <typename State>
+struct flow_entry
+{
+	template <typename... Args>
+	flow_entry(bool const swapped, Args&&... args)
+		: initiator_swapped(swapped)
+		, state(std::forward<Args>(args)...)
+	{}
+
+	// true if the endpoint that opened the flow is the second one in its key
+	bool initiator_swapped;
+	State state;
+};
+
+// an open addressing hash table with linear probing. Keys (and their hashes)
+// are kept in a dense array separate from the values, so a probe sequence only
+// touches a cache line or two. Values are stored inline and move when the table
+// grows, or when a neighbouring entry is erased, so pointers returned by find()
+// are only valid until the next call to emplace() or erase().
+template <typename Key, typename Value, std::uint32_t (*Hash)(Key const&)>
+struct open_hash_table
+{
+	open_hash_table() { rehash(64); }
+
+	Value* find(Key const& k)
+	{
+		std::uint32_t const h = hash(k);
+		for (std::size_t i = h & m_mask;; i = (i + 1) & m_mask) {
+			slot const& s = m_slots[i];
+			if (s.hash == 0) return nullptr;
+			if (s.hash == h && s.key == k) return &*m_values[i];
+		}
+	}
+
+	// the key must not already be in the table
+	template <typename... Args>
+	Value& emplace(Key const& k, Args&&... args)
+	{
+		assert(find(k) == nullptr);
+		if ((m_size + 1) * 4 > m_slots.size() * 3) rehash(m_slots.size() * 2);
+
+		std::uint32_t const h = hash(k);
+		std::size_t i = h & m_mask;
+		while (m_slots[i].hash != 0) i = (i + 1) & m_mask;
+		m_slots[i] = slot{k, h};
+		m_values[i].emplace(std::forward<Args>(args)...);
+		++m_size;
+		return *m_values[i];
+	}
+
+	bool erase(Key const& k)
+	{
+		std::uint32_t const h = hash(k);
+		std::size_t i = h & m_mask;
+		for (;; i = (i + 1) & m_mask) {
+			if (m_slots[i].hash == 0) return false;
+			if (m_slots[i].hash == h && m_slots[i].key == k) break;
+		}
+
+		// backward shift deletion. Move any entry following the hole, whose
+		// probe sequence passes through the hole, into it. This keeps probe
+		// sequences short without tombstones
+		for (std::size_t j = (i + 1) & m_mask;; j = (j + 1) & m_mask) {
+			if (m_slots[j].hash == 0) break;
+			std::size_t const ideal = m_slots[j].hash & m_mask;
+			if (((j - ideal) & m_mask) < ((j - i) & m_mask)) continue;
+			m_slots[i] = m_slots[j];
+			m_values[i] = std::move(m_values[j]);
+			i = j;
+		}
+		m_slots[i].hash = 0;
+		m_values[i].reset();
+		--m_size;
+		return true;
+	}
+
+	// calls f(Key const&, Value&) for every entry. f may not modify the table
+	template <typename Fun>
+	void for_each(Fun&& f)
+	{
+		for (std::size_t i = 0; i < m_slots.size(); ++i) {
+			if (m_slots[i].hash != 0) f(m_slots[i].key, *m_values[i]);
+		}
+	}
+
+	std::size_t size() const { return m_size; }
+
+	// removes all entries, keeping the allocated slots
+	void clear()
+	{
+		std::fill(m_slots.begin(), m_slots.end(), slot{Key{}, 0});
+		for (auto& v : m_values) v.reset();
+		m_size = 0;
+	}
+
+private:
+
+	// 0 is reserved to mean "empty slot". Only that one value is remapped, the
+	// low bits pick the home slot, so they must all be kept
+	static std::uint32_t hash(Key const& k)
+	{
+		std::uint32_t const h = Hash(k);
+		return h ? h : 1;
+	}
+
+	void rehash(std::size_t const new_size)
+	{
+		std::vector<slot> slots(new_size, slot{Key{}, 0});
+		std::vector<std::optional<Value>> values(new_size);
+		std::swap(slots, m_slots);
+		std::swap(values, m_values);
+		m_mask = new_size - 1;
+		for (std::size_t i = 0; i < slots.size(); ++i) {
+			if (slots[i].hash == 0) continue;
+			std::size_t j = slots[i].hash & m_mask;
+			while (m_slots[j].hash != 0) j = (j + 1) & m_mask;
+			m_slots[j] = slots[i];
+			m_values[j] = std::move(values[i]);
+		}
+	}
+
+	struct slot
+	{
+		Key key;
+		std::uint32_t hash;
+	};
+
+	std::vector<slot> m_slots;
+	std::vector<std::optional<Value>> m_values;
+	std::size_t m_mask = 0;
+	std::size_t m_size = 0;
+};
+
+template <typename Value>
+using flow_table = open_hash_table<flow_key, Value, &hash_flow_key>;
@@ -0,0 +1,207 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <sys/time.h>
+
+#include <boost/asio/ip/address_v4.hpp>
+
+#include "span.hpp"
+
+using libtorrent::span;
+using boost::asio::ip::address_v4;
+
+// text is formatted by appending to a buffer like this. These functions don't
+// allocate (once the buffer has grown large enough) and don't depend on any
+// locale or stream state.
+using text_buffer = std::vector<char>;
+
+inline void append(text_buffer& out, std::string_view const s)
+{
+	out.insert(out.end(), s.begin(), s.end());
+}
+
+inline void append(text_buffer& out, char const c)
+{
+	out.push_back(c);
+}
+
+template <typename Int>
+typename std::enable_if<std::is_integral<Int>::value>::type
+append_int(text_buffer& out, Int const val, int const base = 10)
+{
+	char buf[24];
+	auto const r = std::to_chars(buf, buf + sizeof(buf), val, base);
+	out.insert(out.end(), buf, r.ptr);
+}
+
+namespace aux {
+
+	// the two hex digits of every byte value
+	constexpr std::array<char, 512> make_hex_table()
+	{
+		char const digits[] = "0123456789abcdef";
+		std::array<char, 512> ret{};
+		for (int i = 0; i < 256; ++i) {
+			ret[std::size_t(i * 2)] = digits[i >> 4];
+			ret[std::size_t(i * 2 + 1)] = digits[i & 15];
+		}
+		return ret;
+	}
+
+	constexpr std::array<char, 512> hex_table = make_hex_table();
+}
+
+// two lower case hex digits per byte
+inline void append_hex(text_buffer& out, span<unsigned char const> bytes)
+{
+	std::size_t const pos = out.size();
+	out.resize(pos + std::size_t(bytes.size()) * 2);
+	char* ptr = out.data() + pos;
+	for (auto const c : bytes) {
+		ptr[0] = aux::hex_table[std::size_t(c) * 2];
+		ptr[1] = aux::hex_table[std::size_t(c) * 2 + 1];
+		ptr += 2;
+	}
+}
+
+// seconds and milliseconds, e.g. "1589732941.042"
+inline void append_timestamp(text_buffer& out, timeval const& ts)
+{
+	append_int(out, ts.tv_sec);
+	int const ms = int(ts.tv_usec / 1000);
+	char const buf[4] = {'.', char('0' + ms / 100), char('0' + ms / 10 % 10), char('0' + ms % 10)};
+	out.insert(out.end(), buf, buf + 4);
+}
+
+// dotted decimal
+inline void append_address(text_buffer& out, address_v4 const& a)
+{
+	auto const bytes = a.to_bytes();
+	for (std::size_t i = 0; i < bytes.size(); ++i) {
+		if (i > 0) out.push_back('.');
+		append_int(out, int(bytes[i]));
+	}
+}
+
+// the printable ASCII characters of "bytes", with anything else replaced by '.'
+inline void append_printable(text_buffer& out, span<unsigned char const> bytes)
+{
+	for (auto const c : bytes) out.push_back((c >= ' ' && c < 127) ? char(c) : '.');
+}
+
+namespace aux {
+
+	// the eight '0'/'1' characters of every byte value, most significant bit
+	// first
+	constexpr std::array<char, 256 * 8> make_bits_table()
+	{
+		std::array<char, 256 * 8> ret{};
+		for (int i = 0; i < 256; ++i) {
+			for (int bit = 0; bit < 8; ++bit)
+				ret[std::size_t(i * 8 + bit)] = char('0' + ((i >> (7 - bit)) & 1));
+		}
+		return ret;
+	}
+
+	constexpr std::array<char, 256 * 8> bits_table = make_bits_table();
+}
+
+// '0' or '1' for every bit, most significant bit of the first byte first
+inline void append_bits(text_buffer& out, span<unsigned char const> bytes)
+{
+	std::size_t const pos = out.size();
+	out.resize(pos + std::size_t(bytes.size()) * 8);
+	char* ptr = out.data() + pos;
+	for (auto const c : bytes) {
+		std::memcpy(ptr, aux::bits_table.data() + std::size_t(c) * 8, 8);
+		ptr += 8;
+	}
+}
+
+// the number of bits set
+inline std::uint64_t popcount(span<unsigned char const> bytes)
+{
+	std::uint64_t ret = 0;
+	std::ptrdiff_t i = 0;
+	for (; i + 8 <= bytes.size(); i += 8) {
+		std::uint64_t word;
+		std::memcpy(&word, bytes.data() + i, 8);
+		ret += std::uint64_t(__builtin_popcountll(word));
+	}
+	for (; i < bytes.size(); ++i) ret += std::uint64_t(__builtin_popcount(bytes[i]));
+	return ret;
+}
+
+// runs of equal bits, as <bit>x<count>, e.g. "1x1000 0x24"
+inline void append_bit_runs(text_buffer& out, span<unsigned char const> bytes)
+{
+	int bit = -1;
+	std::uint64_t run = 0;
+	bool first = true;
+	auto const flush = [&]
+	{
+		if (run == 0) return;
+		if (!first) out.push_back(' ');
+		first = false;
+		out.push_back(char('0' + bit));
+		out.push_back('x');
+		append_int(out, run);
+	};
+	for (auto const c : bytes) {
+		// whole bytes of the same bit, the common case
+		if ((c == 0 || c == 0xff) && bit == (c & 1)) {
+			run += 8;
+			continue;
+		}
+		for (int i = 7; i >= 0; --i) {
+			int const b = (c >> i) & 1;
+			if (b == bit) {
+				++run;
+				continue;
+			}
+			flush();
+			bit = b;
+			run = 1;
+		}
+	}
+	flush();
+}
@@ -0,0 +1,268 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <ostream>
+#include <vector>
+
+#include <boost/asio/ip/address_v4.hpp>
+
+#include "flow_table.hpp"
+#include "span.hpp"
+#include "payload_arena.hpp"
+
+using libtorrent::span;
+
+// identifies the IP datagram a fragment belongs to (RFC 791). Addresses are in
+// host byte order
+struct fragment_key
+{
+	std::uint32_t src;
+	std::uint32_t dst;
+	std::uint16_t fragment_id;
+	std::uint8_t protocol;
+	std::uint8_t pad;
+
+	friend bool operator==(fragment_key const& lhs, fragment_key const& rhs)
+	{
+		return std::memcmp(&lhs, &rhs, sizeof(fragment_key)) == 0;
+	}
+
+	friend std::ostream& operator<<(std::ostream& os, fragment_key const& k)
+	{
+		return os << boost::asio::ip::address_v4(k.src) << " -> "
+			<< boost::asio::ip::address_v4(k.dst) << ": " << k.fragment_id;
+	}
+};
+
+static_assert(sizeof(fragment_key) == 12, "fragment_key is expected to be packed");
+
+inline std::uint32_t hash_fragment_key(fragment_key const& k)
+{
+	std::uint64_t const a = (std::uint64_t(k.src) << 32) | k.dst;
+	std::uint64_t const b = (std::uint64_t(k.fragment_id) << 8) | k.protocol;
+	std::uint64_t h = (a ^ (b << 43) ^ b) * 0x9e3779b97f4a7c15ull;
+	h ^= h >> 29;
+	return std::uint32_t(h >> 32);
+}
+
+struct reassembly_stats
+{
+	// datagrams whose every byte was received
+	std::uint64_t reassembled = 0;
+	// incomplete datagrams dropped because the rest of their fragments didn't
+	// arrive in time
+	std::uint64_t timed_out = 0;
+	// incomplete datagrams dropped to make room for new ones
+	std::uint64_t evicted = 0;
+	// fragments covering bytes we had already received
+	std::uint64_t overlapping = 0;
+
+	reassembly_stats& operator+=(reassembly_stats const& rhs)
+	{
+		reassembled += rhs.reassembled;
+		timed_out += rhs.timed_out;
+		evicted += rhs.evicted;
+		overlapping += rhs.overlapping;
+		return *this;
+	}
+
+	friend std::ostream& operator<<(std::ostream& os, reassembly_stats const& st)
+	{
+		return os << "reassembled " << st.reassembled << " IP datagrams ("
+			<< st.timed_out << " timed out, " << st.evicted << " evicted, "
+			<< st.overlapping << " overlapping fragments)";
+	}
+};
+
+// reassembles fragmented IP datagrams. Each datagram being reassembled is
+// given a fixed size buffer (large enough for any IP datagram) from the payload
+// arena, fragments are copied straight into place and the ranges still missing are
+// tracked as a list of holes, as described in RFC 815. A datagram is complete
+// once there are no holes left, regardless of the order its fragments arrived
+// in.
+//
+// Incomplete datagrams are dropped once they're older than "timeout" seconds,
+// or when there are "max_datagrams" of them and room is needed for another.
+// Time is taken from packet timestamps and is expected to (mostly) move
+// forward.
+struct ip_reassembly
+{
+	explicit ip_reassembly(std::int64_t const timeout = 30
+		, std::size_t const max_datagrams = 1024)
+		: m_timeout(timeout)
+		, m_max_datagrams(max_datagrams)
+	{}
+
+	// "offset" is the fragment offset (in bytes) and "payload" the IP payload
+	// of the fragment. Once the whole datagram has been received, its payload
+	// is returned. The returned span is valid until the next call to add() or
+	// expire(). An empty span means the datagram isn't complete yet.
+	span<unsigned char const> add(std::int64_t const now, fragment_key const& k
+		, int const offset, bool const more_fragments, span<unsigned char const> payload)
+	{
+		m_completed.reset();
+		expire(now);
+
+		std::uint32_t const begin = std::uint32_t(offset);
+		std::uint32_t const end = begin + std::uint32_t(payload.size());
+		// this can't be a valid fragment
+		if (end > max_datagram_size) return {};
+
+		datagram* d = m_datagrams.find(k);
+		if (d == nullptr) {
+			if (m_datagrams.size() >= m_max_datagrams) evict_oldest();
+			d = &m_datagrams.emplace(k, now, ++m_serial);
+			d->holes.assign(1, hole{0, max_datagram_size});
+			m_queue.push_back(queue_entry{k, d->serial, now});
+		}
+
+		// fill in any hole this fragment overlaps. The part of the hole before
+		// the fragment remains a hole, and so does the part after it, unless
+		// this is the last fragment
+		auto& holes = d->holes;
+		std::uint32_t filled = 0;
+		for (std::size_t i = 0; i < holes.size();) {
+			hole const h = holes[i];
+			if (begin >= h.end || end <= h.begin) {
+				++i;
+				continue;
+			}
+			filled += std::min(end, h.end) - std::max(begin, h.begin);
+			holes[i] = holes.back();
+			holes.pop_back();
+			if (begin > h.begin) holes.push_back(hole{h.begin, begin});
+			if (end < h.end && more_fragments) holes.push_back(hole{end, h.end});
+		}
+		if (filled < end - begin) ++m_stats.overlapping;
+
+		std::memcpy(d->buf.data() + begin, payload.data(), std::size_t(payload.size()));
+		if (!more_fragments) d->size = end;
+
+		if (!holes.empty()) return {};
+
+		++m_stats.reassembled;
+		std::uint32_t const size = d->size;
+		m_completed = std::move(d->buf);
+		m_datagrams.erase(k);
+		return span<unsigned char const>(m_completed.data(), size);
+	}
+
+	// drops all incomplete datagrams whose first fragment arrived at least
+	// "timeout" seconds before "now"
+	void expire(std::int64_t const now)
+	{
+		while (!m_queue.empty()) {
+			queue_entry const& q = m_queue.front();
+			datagram* d = m_datagrams.find(q.key);
+			if (d != nullptr && d->serial == q.serial) {
+				if (now - q.first_seen < m_timeout) break;
+				m_datagrams.erase(q.key);
+				++m_stats.timed_out;
+			}
+			m_queue.pop_front();
+		}
+	}
+
+	reassembly_stats const& stats() const { return m_stats; }
+
+	// the number of incomplete datagrams
+	std::size_t size() const { return m_datagrams.size(); }
+
+private:
+
+	static constexpr std::uint32_t max_datagram_size = 0x10000;
+
+	// the byte range [begin, end) is missing
+	struct hole
+	{
+		std::uint32_t begin;
+		std::uint32_t end;
+	};
+
+	using buffer = arena_buffer<arena_tag::ip_fragments>;
+
+	struct datagram
+	{
+		datagram(std::int64_t const t, std::uint64_t const s)
+			: buf(max_datagram_size), first_seen(t), serial(s)
+		{}
+
+		buffer buf;
+		std::vector<hole, arena_allocator<hole, arena_tag::ip_fragments>> holes;
+		std::int64_t first_seen;
+		// tells this datagram apart from earlier ones with the same key, that
+		// may still be in m_queue
+		std::uint64_t serial;
+		// the size of the payload. Only known once the last fragment arrives
+		std::uint32_t size = 0;
+	};
+
+	struct queue_entry
+	{
+		fragment_key key;
+		std::uint64_t serial;
+		std::int64_t first_seen;
+	};
+
+	void evict_oldest()
+	{
+		while (!m_queue.empty()) {
+			queue_entry const q = m_queue.front();
+			m_queue.pop_front();
+			datagram* d = m_datagrams.find(q.key);
+			if (d == nullptr || d->serial != q.serial) continue;
+			m_datagrams.erase(q.key);
+			++m_stats.evicted;
+			return;
+		}
+	}
+
+	std::int64_t m_timeout;
+	std::size_t m_max_datagrams;
+
+	open_hash_table<fragment_key, datagram, &hash_fragment_key> m_datagrams;
+
+	// datagrams in the order they were started. Entries are removed lazily, so
+	// this may refer to datagrams that have already completed
+	std::deque<queue_entry> m_queue;
+
+	// the buffer of the last datagram returned by add()
+	buffer m_completed;
+
+	std::uint64_t m_serial = 0;
+	reassembly_stats m_stats;
+};
@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <iomanip>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <vector>
 
 #include <net/ethernet.h>
@@ -46,100 +47,175 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/asio/ip/address_v4.hpp>
 
+#include "flow_table.hpp"
 #include "tcp_state.hpp"
 #include "utp_state.hpp"
-#include "pcap.hpp"
+#include "utp_index.hpp"
+#include "timer_wheel.hpp"
+#include "ip_reassembly.hpp"
+#include "payload_arena.hpp"
+#include "capture_reader.hpp"
+#include "flow_dispatcher.hpp"
 #include "str.hpp"
 #include "bittorrent.hpp"
+#include "event_sink.hpp"
+#include "binary_log.hpp"
+#include "segment_sink.hpp"
+#include "summary.hpp"
+#include "request_tracker.hpp"
+#include "flow_filter.hpp"
 
 using libtorrent::span;
 using boost::asio::ip::address_v4;
 
 struct logger
 {
-	logger(stream_key const& key)
+	logger(stream_key const& key, std::uint64_t const flow_id)
 	{
-		log[0].open(str("tcp/", key.src, ":", key.src_port, "-", key.dst, ":", key.dst_port, "-", this, "-in"));
-		log[1].open(str("tcp/", key.src, ":", key.src_port, "-", key.dst, ":", key.dst_port, "-", this, "-out"));
+		log[0].open(str("tcp/", key.src, ":", key.src_port, "-", key.dst, ":", key.dst_port, "-", flow_id, "-in"));
+		log[1].open(str("tcp/", key.src, ":", key.src_port, "-", key.dst, ":", key.dst_port, "-", flow_id, "-out"));
 	}
 
-	void data(span<unsigned char const> buf, dir_t d)
+	void transport(timeval const&, std::size_t, dir_t) {}
+
+	verdict data(span<unsigned char const> buf, dir_t d)
 	{
 //		std::cout << "incoming " << buf.size() << " bytes\n";
 		log[std::uint8_t(d)].write((char const*)buf.data(), buf.size());
+		return verdict::keep;
 	}
 
 private:
 	std::ofstream log[2];
 };
 
-struct fragment_key
+struct processor_stats
 {
-	std::uint16_t fragment_id;
-	address_v4 src;
-	address_v4 dst;
+	// the number of flows dropped because they were idle for too long
+	std::uint64_t expired_flows = 0;
+
+	// the number of flows the handler asked to drop (because they aren't
+	// BitTorrent, or are of a torrent we're not following)
+	std::uint64_t dropped_flows = 0;
+
+	// the number of flows not opened because neither endpoint matched the
+	// peer filter
+	std::uint64_t filtered_flows = 0;
+
+	// the number of packets the capture's snaplen cut short. Headers that
+	// were cut are skipped, payload is passed on as far as it goes
+	std::uint64_t truncated_packets = 0;
 
-	friend std::ostream& operator<<(std::ostream& os, fragment_key const& st)
+	reassembly_stats fragments;
+
+	// the payload arena of the thread running the processor
+	arena_stats memory;
+
+	processor_stats& operator+=(processor_stats const& rhs)
 	{
-		return os << st.src << " -> " << st.dst << ": " << st.fragment_id;
+		expired_flows += rhs.expired_flows;
+		dropped_flows += rhs.dropped_flows;
+		filtered_flows += rhs.filtered_flows;
+		truncated_packets += rhs.truncated_packets;
+		fragments += rhs.fragments;
+		memory += rhs.memory;
+		return *this;
 	}
 
-	friend bool operator<(fragment_key const& lhs, fragment_key const& rhs)
+	friend std::ostream& operator<<(std::ostream& os, processor_stats const& st)
 	{
-		return std::tie(lhs.fragment_id, lhs.src, lhs.dst)
-			< std::tie(rhs.fragment_id, rhs.src, rhs.dst);
+		return os << "expired " << st.expired_flows << " idle flows, dropped "
+			<< st.dropped_flows << " flows that aren't BitTorrent (or filtered by info-hash), "
+			<< "filtered " << st.filtered_flows << " flows by peer, "
+			<< st.truncated_packets << " truncated packets\n"
+			<< st.fragments << '\n' << st.memory;
 	}
 };
 
+// every flow has a timer in the timer wheel. The flow it refers to may have
+// been closed and its slot re-used by the time the timer fires, which is why
+// the flow ID is recorded too
+struct flow_timer
+{
+	// the key of a TCP stream or the ID of a uTP stream in utp_index
+	flow_key key;
+	std::uint32_t utp_id;
+	bool utp;
+	std::uint64_t flow_id;
+};
+
 template <typename Handler>
 struct processor
 {
-
-static void handler_wrapper(u_char *user_data, pcap_pkthdr const* pkthdr, u_char const* packet)
+	// flows that haven't seen a packet for "idle_timeout" seconds are closed
+	// and dropped. 0 means never. Streams are logged to "sink", and only flows
+	// matching "filter" are followed. The statistics of streams go to "logs".
+	// All of them must outlive the processor
+	processor(std::int64_t const idle_timeout, event_sink* sink, flow_filter const* filter
+		, stats_logs const* logs)
+		: sink_(sink)
+		, filter_(filter)
+		, logs_(logs)
+		, idle_timeout_(idle_timeout)
+	{}
+
+// moves the clock forward to "ts", expiring any flow that has been idle for
+// too long by then. This is called for every packet, but it's also useful to
+// expire flows at the end of a capture
+void advance(timeval const& ts)
 {
-	auto* self = reinterpret_cast<processor<Handler>*>(user_data);
-	if (pkthdr->len != pkthdr->caplen) {
-		std::cout << " ERROR: missing data in capture! packet: " << pkthdr->len << " B captured: " << pkthdr->caplen << "B\n";
-	}
-	span<unsigned char const> pkt(packet, pkthdr->len);
-	self->process(pkthdr->ts, pkt);
+	ip_fragments_.expire(ts.tv_sec);
+
+	if (idle_timeout_ == 0) return;
+
+	timers_.advance(ts.tv_sec, [this](flow_timer const& t)
+	{
+		if (t.utp) {
+			auto* s = utp_streams_.get(t.utp_id);
+			if (s == nullptr || s->flow_id != t.flow_id) return;
+			if (expire_idle(*s, t)) utp_streams_.erase(t.utp_id);
+		}
+		else {
+			auto* f = tcp_streams_.find(t.key);
+			if (f == nullptr || f->state.flow_id != t.flow_id) return;
+			if (expire_idle(f->state, t)) tcp_streams_.erase(t.key);
+		}
+	});
 }
 
-std::pair<typename std::map<utp_stream_key, utp_state<Handler>>::iterator, dir_t>
-find_utp_stream(utp_stream_key const s)
+processor_stats stats() const
 {
-	auto it = utp_streams_.find(s);
-	dir_t d = dir_t::out;
-	if (it == utp_streams_.end()) {
-		it = utp_streams_.find(swap(s, 0));
-		d = dir_t::in;
-		if (it == utp_streams_.end()) {
-			it = utp_streams_.find(swap(s, 1));
-			if (it == utp_streams_.end()) {
-				it = utp_streams_.find(swap(s, -1));
-				if (it == utp_streams_.end()) {
-					return {utp_streams_.end(), dir_t::out};
-				}
-			}
-		}
-	}
-	return {it, d};
+	processor_stats ret = stats_;
+	ret.fragments = ip_fragments_.stats();
+	ret.memory = payload_arena::local().stats();
+	return ret;
 }
 
-void process(timeval const& ts, span<unsigned char const> pkt)
+
+// "index" is the position of this packet in the capture. It's used to give
+// flows an ID that doesn't depend on which other flows are processed by this
+// processor.
+void process(timeval const& ts, span<unsigned char const> pkt, std::uint64_t const index)
 {
+	advance(ts);
+
 // TODO: ensure this is an ethernet frame, and maybe even support other physical links
 
+	if (pkt.size() < std::ptrdiff_t(sizeof(ether_header))) {
+		++stats_.truncated_packets;
+		return;
+	}
 	auto const& eth_header = cast<ether_header const>(pkt);
 	pkt = pkt.subspan(sizeof(ether_header));
 
 	// we're only interested in IP packets
 	if (ntohs(eth_header.ether_type) != ETHERTYPE_IP) return;
 
+	if (pkt.size() < std::ptrdiff_t(sizeof(ip))) {
+		++stats_.truncated_packets;
+		return;
+	}
 	auto const& ip_header = cast<ip const>(pkt);
-	// read the header length to skip over IP option headers too
-	int const ip_header_len = int(ip_header.ip_hl) * 4;
-	pkt = pkt.subspan(ip_header_len, ntohs(ip_header.ip_len) - ip_header_len);
 
 	if (ip_header.ip_hl < 5) {
 		// invalid packet
@@ -150,46 +226,48 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 	// we only support IPv4
 	if (ip_header.ip_v != 4) return;
 
+	// read the header length to skip over IP option headers too
+	int const ip_header_len = int(ip_header.ip_hl) * 4;
+	int const ip_len = ntohs(ip_header.ip_len);
+	if (ip_len < ip_header_len) return;
+	if (pkt.size() < ip_len) {
+		// the capture's snaplen cut the record short. We make do with what
+		// there is of it
+		++stats_.truncated_packets;
+		if (pkt.size() < ip_header_len) return;
+	}
+	pkt = pkt.subspan(ip_header_len, std::min(ip_len, int(pkt.size())) - ip_header_len);
+
 	bool const more_fragments = ntohs(ip_header.ip_off) & IP_MF;
 	int const fragment_offset = (ntohs(ip_header.ip_off) & IP_OFFMASK) * 8;
 
-	// this is used to store re-assembled fragmented packets
-	std::vector<unsigned char> scratch_buffer;
-
 	if (more_fragments || fragment_offset != 0) {
 
-		fragment_key s{ntohs(ip_header.ip_id)
-			, address_v4(ntohl(ip_header.ip_src.s_addr))
-			, address_v4(ntohl(ip_header.ip_dst.s_addr))};
+		fragment_key const s{ntohl(ip_header.ip_src.s_addr)
+			, ntohl(ip_header.ip_dst.s_addr)
+			, ntohs(ip_header.ip_id)
+			, ip_header.ip_p
+			, 0};
+
+		// a fragment cut short would corrupt the datagram it's part of
+		if (ip_len - ip_header_len != pkt.size()) return;
 
 		if (more_fragments && (pkt.size() % 8) != 0) {
 			std::cout << "ERROR: fragmented packet size not divisible by 8: " << pkt.size() << "\n";
 		}
 
-		// we currently employ a simplistic fragment-reassembly by assuming
-		// that by the time we receive the last fragment, we have received them
-		// all
-
-		auto& reassembled = ip_fragments_[s];
-
-		if (reassembled.size() < std::size_t(fragment_offset) + pkt.size()) {
-			reassembled.resize(fragment_offset + pkt.size());
-		}
-
-		std::memcpy(reassembled.data() + fragment_offset, pkt.data(), pkt.size());
+		pkt = ip_fragments_.add(ts.tv_sec, s, fragment_offset, more_fragments, pkt);
 
 		// we're not done reassembling the packet yet
-		if (more_fragments) return;
-
-		scratch_buffer = std::move(reassembled);
-		pkt = span<unsigned char const>(scratch_buffer);
-		ip_fragments_.erase(s);
+		if (pkt.empty()) return;
 	}
 
 	if (ip_header.ip_p == IPPROTO_TCP) {
+		if (pkt.size() < std::ptrdiff_t(sizeof(tcphdr))) {
+			++stats_.truncated_packets;
+			return;
+		}
 		auto const& tcp_header = cast<tcphdr const>(pkt);
-		// read the data offset header to skip over TCP options
-		pkt = pkt.subspan(int(tcp_header.th_off) * 4);
 
 		if (tcp_header.th_off < 5) {
 			// invalid packet
@@ -197,80 +275,90 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 			return;
 		}
 
-		stream_key const s{
-			address_v4(ntohl(ip_header.ip_src.s_addr)),
-			address_v4(ntohl(ip_header.ip_dst.s_addr)),
-			ntohs(tcp_header.source),
-			ntohs(tcp_header.dest)
-		};
+		// read the data offset header to skip over TCP options
+		if (pkt.size() < int(tcp_header.th_off) * 4) {
+			++stats_.truncated_packets;
+			return;
+		}
+		pkt = pkt.subspan(int(tcp_header.th_off) * 4);
 
-//		std::cout << "TCP " << s << '\n';
+		std::uint16_t const src_port = ntohs(tcp_header.source);
+		std::uint16_t const dst_port = ntohs(tcp_header.dest);
+		auto const [key, swapped] = make_flow_key(ntohl(ip_header.ip_src.s_addr), src_port
+			, ntohl(ip_header.ip_dst.s_addr), dst_port);
+
+		// a single probe tells us both whether we're tracking this flow and, by
+		// comparing the endpoint order with that of the SYN, which direction
+		// this packet is going in
+		auto* f = tcp_streams_.find(key);
+		dir_t const d = (f == nullptr || f->initiator_swapped == swapped) ? dir_t::out : dir_t::in;
+		if (f != nullptr) f->state.last_seen = ts.tv_sec;
 
 		if (tcp_header.syn && tcp_header.ack) {
 			// this is a response, so the stream is already open
 			// in the "other direction".
-			auto const it = tcp_streams_.find(swap(s));
-			if (it == tcp_streams_.end()) {
-//				std::cout << "ignoring TCP SYN+ACK " << s << '\n';
+			if (f == nullptr || d != dir_t::in) {
+//				std::cout << "ignoring TCP SYN+ACK " << key << '\n';
 				return;
 			}
-//			std::cout << "TCP SYN+ACK " << s << '\n';
-			it->second.syn(tcp_header, dir_t::in);
+//			std::cout << "TCP SYN+ACK " << key << '\n';
+			f->state.syn(tcp_header, dir_t::in);
 			if (pkt.size() > 0) std::cout << "SYN+ACK with payload!\n";
 			return;
 		}
 
 		if (tcp_header.syn) {
 			// this is initiating a new stream.
-			auto it = tcp_streams_.find(s);
-			if (it != tcp_streams_.end()) {
-//				std::cout << "ignoring TCP SYN " << s << '\n';
+			if (f != nullptr) {
+				if (d == dir_t::out) {
+//					std::cout << "ignoring TCP SYN " << key << '\n';
+					return;
+				}
+				// the other end is opening a new connection re-using the same
+				// endpoints. The old one must be dead
+				tcp_streams_.erase(key);
+			}
+//			std::cout << "TCP SYN " << key << '\n';
+			stream_key const s{
+				address_v4(ntohl(ip_header.ip_src.s_addr)),
+				address_v4(ntohl(ip_header.ip_dst.s_addr)),
+				src_port,
+				dst_port
+			};
+			// flows of peers we're not interested in are never opened, their
+			// segments are discarded like those of any unknown flow
+			if (!filter_->match_peers(key.addr[0], key.addr[1])) {
+				++stats_.filtered_flows;
 				return;
 			}
-//			std::cout << "TCP SYN " << s << '\n';
-			it = tcp_streams_.emplace(s, tcp_state<Handler>{s}).first;
-			it->second.syn(tcp_header, dir_t::out);
+			auto& e = tcp_streams_.emplace(key, swapped, s, index, *sink_, *filter_, *logs_);
+			e.state.syn(tcp_header, dir_t::out);
+			start_timer(e.state, ts, flow_timer{key, 0, false, index});
 			if (pkt.size() > 0) std::cout << "SYN with payload!\n";
 			return;
 		}
 
-		auto it = tcp_streams_.find(s);
-		if (it != tcp_streams_.end()) {
-			if (tcp_header.fin) {
-//				std::cout << "TCP FIN " << s << '\n';
-				if (it->second.fin(ts, dir_t::out)) tcp_streams_.erase(it);
-			}
-			else if (tcp_header.rst) {
-//				std::cout << "TCP RST " << s << '\n';
-				it->second.rst(ts, dir_t::out);
-				tcp_streams_.erase(it);
-			}
-			else {
-//				std::cout << "TCP " << s << '\n';
-				it->second.packet(ts, tcp_header, pkt, dir_t::out);
-			}
+		if (f == nullptr) {
+//			std::cout << "ignoring TCP segment " << key << '\n';
 			return;
 		}
 
-		it = tcp_streams_.find(swap(s));
-		if (it != tcp_streams_.end()) {
-			if (tcp_header.fin) {
-//				std::cout << "TCP FIN " << s << '\n';
-				if (it->second.fin(ts, dir_t::in)) tcp_streams_.erase(it);
-			}
-			else if (tcp_header.rst) {
-//				std::cout << "TCP RST " << s << '\n';
-				it->second.rst(ts, dir_t::in);
-				tcp_streams_.erase(it);
-			}
-			else {
-//				std::cout << "TCP " << s << '\n';
-				it->second.packet(ts, tcp_header, pkt, dir_t::in);
-			}
-			return;
+		if (tcp_header.fin) {
+//			std::cout << "TCP FIN " << key << '\n';
+			if (f->state.fin(ts, d)) tcp_streams_.erase(key);
+		}
+		else if (tcp_header.rst) {
+//			std::cout << "TCP RST " << key << '\n';
+			f->state.rst(ts, d);
+			tcp_streams_.erase(key);
+		}
+		// the segments of a dropped flow are only looked at to know when it's
+		// closed
+		else if (!f->state.dropped()) {
+//			std::cout << "TCP " << key << '\n';
+			f->state.packet(ts, tcp_header, pkt, d);
+			if (f->state.dropped()) ++stats_.dropped_flows;
 		}
-
-//		std::cout << "ignoring TCP segment " << s << '\n';
 	}
 	else if (ip_header.ip_p == IPPROTO_UDP && pkt.size() >= std::ptrdiff_t(sizeof(utphdr) + sizeof(udphdr))) {
 
@@ -279,19 +367,22 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 
 		auto const& utp_header = cast<utphdr const>(pkt);
 
-		stream_key const k{
-			address_v4(ntohl(ip_header.ip_src.s_addr)),
-			address_v4(ntohl(ip_header.ip_dst.s_addr)),
-			ntohs(udp_header.source),
-			ntohs(udp_header.dest)
-		};
+		std::uint16_t const src_port = ntohs(udp_header.source);
+		std::uint16_t const dst_port = ntohs(udp_header.dest);
 
 		// make sure this is in fact a uTP packet
 		if (utp_header.get_version() != 1) return;
 		if (utp_header.get_type() >= NUM_TYPES) return;
 		if (utp_header.extension >= 3) return;
-		if (k.src_port == 443) return;
-		if (k.dst_port == 443) return;
+		if (src_port == 443) return;
+		if (dst_port == 443) return;
+
+		auto const ck = make_flow_key(ntohl(ip_header.ip_src.s_addr), src_port
+			, ntohl(ip_header.ip_dst.s_addr), dst_port);
+		bool const syn = utp_header.get_type() == ST_SYN;
+
+		// only a SYN can open a new stream on a pair we've seen no uTP on
+		if (!syn && utp_streams_.known_non_utp(ck.key)) return;
 
 		// we need to parse utp header options to know how large the header is
 		pkt = pkt.subspan(sizeof(utphdr));
@@ -299,7 +390,8 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 		while (extension != 0) {
 			if (pkt.size() < 2) {
 				// this is most likely not a uTP packet
-//				std::cout << "ERROR: invalid uTP header options in " << k << '\n';
+//				std::cout << "ERROR: invalid uTP header options in " << ck.key << '\n';
+				utp_streams_.add_non_utp(ck.key);
 				return;
 			}
 
@@ -308,84 +400,386 @@ void process(timeval const& ts, span<unsigned char const> pkt)
 
 			if (pkt.size() < len + 2) {
 				// this is most likely not a uTP packet
-//				std::cout << "ERROR: invalid uTP header options in " << k << '\n';
+//				std::cout << "ERROR: invalid uTP header options in " << ck.key << '\n';
+				utp_streams_.add_non_utp(ck.key);
 				return;
 			}
 			pkt = pkt.subspan(2 + len);
 		}
 
-		utp_stream_key const s{k, std::uint16_t(utp_header.connection_id) };
-
-		auto [it, d] = find_utp_stream(s);
+		std::uint16_t const connid = utp_header.connection_id;
+		auto const r = utp_streams_.find(ck, connid);
+		if (r.state != nullptr) r.state->last_seen = ts.tv_sec;
 
-		if (utp_header.get_type() == ST_SYN) {
-			if (it != utp_streams_.end()) {
-				it->second.syn(utp_header, d);
-//				if (d == dir_t::out)
-//					std::cout << "uTP SYN " << s << '\n';
+		if (syn) {
+			if (r.state != nullptr) {
+				r.state->syn(utp_header, r.dir);
+//				if (r.dir == dir_t::out)
+//					std::cout << "uTP SYN " << ck.key << '\n';
 //				else
-//					std::cout << "uTP SYN+ACK " << s << '\n';
+//					std::cout << "uTP SYN+ACK " << ck.key << '\n';
+				return;
+			}
+			// a re-sent SYN is found by the connection ID the initiator uses
+			// for the rest of the stream
+			auto const resent = utp_streams_.find(ck, std::uint16_t(connid + 1));
+			if (resent.state != nullptr && resent.dir == dir_t::out) {
+				resent.state->last_seen = ts.tv_sec;
+				resent.state->syn(utp_header, dir_t::out);
 				return;
 			}
-			it = utp_streams_.emplace(inc_connid(s, 1), utp_state<Handler>{s}).first;
-			it->second.syn(utp_header, dir_t::out);
-//			std::cout << "uTP SYN " << s << '\n';
+			stream_key const k{
+				address_v4(ntohl(ip_header.ip_src.s_addr)),
+				address_v4(ntohl(ip_header.ip_dst.s_addr)),
+				src_port,
+				dst_port
+			};
+			if (!filter_->match_peers(ck.key.addr[0], ck.key.addr[1])) {
+				++stats_.filtered_flows;
+				return;
+			}
+			auto const e = utp_streams_.emplace(ck, connid, utp_stream_key{k, connid}, index, *sink_, *filter_
+				, *logs_);
+			e.state->syn(utp_header, dir_t::out);
+			start_timer(*e.state, ts, flow_timer{ck.key, e.id, true, index});
+//			std::cout << "uTP SYN " << k << '\n';
 			return;
 		}
 
-		if (it == utp_streams_.end()) {
+		if (r.state == nullptr) {
 // this may not actually be a utp packet.
-//			std::cout << "ignoring uTP segment " << s << '\n';
+//			std::cout << "ignoring uTP segment " << ck.key << '\n';
+			utp_streams_.add_non_utp(ck.key);
 			return;
 		}
 
 		if (utp_header.get_type() == ST_FIN) {
-			if (it->second.fin(ts, d)) {
-				utp_streams_.erase(it);
+			if (r.state->fin(ts, r.dir)) {
+				utp_streams_.erase(r.id);
 			}
 			return;
 		}
 
 		if (utp_header.get_type() == ST_RESET) {
-			it->second.rst(ts, d);
-			utp_streams_.erase(it);
+			r.state->rst(ts, r.dir);
+			utp_streams_.erase(r.id);
 			return;
 		}
 
-//		std::cout << "uTP " << s << '\n';
-		it->second.packet(ts, utp_header, pkt, d);
+		// the packets of a dropped stream are only looked at to know when
+		// it's closed
+		if (r.state->dropped()) return;
+
+//		std::cout << "uTP " << ck.key << '\n';
+		r.state->packet(ts, utp_header, pkt, r.dir);
+		if (r.state->dropped()) ++stats_.dropped_flows;
 
 	}
 }
 
 private:
-	std::map<stream_key, tcp_state<Handler>> tcp_streams_;
-	std::map<utp_stream_key, utp_state<Handler>> utp_streams_;
+
+	template <typename State>
+	void start_timer(State& s, timeval const& ts, flow_timer const& t)
+	{
+		s.last_seen = ts.tv_sec;
+		if (idle_timeout_ == 0) return;
+		timers_.schedule(s.last_seen + idle_timeout_, t);
+	}
+
+	// if the flow has seen packets since the timer was set, the timer is
+	// pushed out to the new deadline. Otherwise the flow is told it timed out
+	// and true is returned, the caller is expected to drop it
+	template <typename State>
+	bool expire_idle(State& s, flow_timer const& t)
+	{
+		std::int64_t const deadline = s.last_seen + idle_timeout_;
+		if (deadline > timers_.now()) {
+			timers_.schedule(deadline, t);
+			return false;
+		}
+		// the timestamp is derived from the flow itself (rather than the clock)
+		// to make the output the same regardless of which other flows are
+		// processed alongside it
+		timeval ts{};
+		ts.tv_sec = time_t(deadline);
+		s.timeout(ts);
+		++stats_.expired_flows;
+		return true;
+	}
+
+	event_sink* sink_;
+	flow_filter const* filter_;
+	stats_logs const* logs_;
+
+	flow_table<flow_entry<tcp_state<Handler>>> tcp_streams_;
+	utp_index<utp_state<Handler>> utp_streams_;
 
 	// we don't store the IP header in the reassembled packet. When we receive
-	// the last fragment, we just use the header from that packet as the IP
-	// header.
-	std::map<fragment_key, std::vector<unsigned char>> ip_fragments_;
+	// the fragment completing a datagram, we just use the header from that
+	// packet as the IP header.
+	ip_reassembly ip_fragments_;
+
+	std::int64_t idle_timeout_;
+	timer_wheel<flow_timer> timers_;
+	processor_stats stats_;
 };
 
-int main(int const argc, char const* argv[]) try
+int print_usage()
 {
-	pcap_handle h = pcap_open(argv[1]);
+	std::cout << R"(tracebt [OPTIONS] pcap-file
+
+OPTIONS:
+--help              print this message
+--threads <n>       Process the capture on <n> worker threads. Flows are
+                    sharded across workers by IP address pair. The output is
+                    identical to a single threaded run. Defaults to 1.
+--idle-timeout <s>  Close and drop flows that haven't seen a packet in <s>
+                    seconds (according to the capture's timestamps). 0 keeps
+                    flows around until they are closed. Defaults to 600.
+--bitfield <format> How to log BITFIELD messages. "full" logs every bit,
+                    "summary" the number of pieces the peer has and "runs" the
+                    summary followed by runs of equal bits. Defaults to full.
+--binary-log <file> Instead of a text file per stream under bt/, log the
+                    events of all streams as binary records to <file>. Use
+                    tracebt-dump to convert it to text.
+--segments          Instead of a text file per stream, log the events of all
+                    streams of a torrent to bt/<info-hash>.seg (in the
+                    --binary-log format). Only a bounded number of files are
+                    open at any time.
+--materialize       Like --segments, but once the capture has been processed,
+                    convert the segment files to the text file per stream
+                    (and remove them).
+--summary <prefix>  Instead of logging the events of streams, count them, and
+                    write a table of every stream and torrent to
+                    <prefix>.csv, <prefix>-torrents.csv and (in binary)
+                    <prefix>.bin.
+--latency <prefix>  Time how long peers take to answer REQUESTs with PIECE
+                    messages, and write the latencies of every stream and
+                    torrent to <prefix>.csv and <prefix>-torrents.csv. May be
+                    combined with any of the above.
+--queue-profile <prefix>
+                    Follow the number of outstanding requests (and bytes) of
+                    every stream. The largest queue in each second is written
+                    to <prefix>.csv, the intervals where the queue was empty
+                    while the peer was unchoked (and we interested) to
+                    <prefix>-starved.csv, and a row per stream to
+                    <prefix>-flows.csv. May be combined with any of the
+                    above.
+--rates <prefix>    Count the bytes received in each direction of every stream
+                    in 100 ms bins, both TCP/uTP payload and PIECE blocks, and
+                    write the rate curves to <prefix>.csv (or <prefix>.bin)
+                    and a row per stream to <prefix>-flows.csv. May be
+                    combined with any of the above.
+--rates-format <f>  "csv" or "binary" (see src/rate_profile.hpp). Defaults to
+                    csv.
+--info-hash <hex>   Only follow streams of this torrent. May be given more
+                    than once.
+--peer <cidr>       Only follow streams with an endpoint in this subnet (e.g.
+                    10.0.0.0/8 or a single address). May be given more than
+                    once.
+)";
+	return 1;
+}
 
-//	processor<logger> p;
-	processor<parse_bittorrent> p;
+int main(int argc, char const* argv[]) try
+{
+	if (argc == 1) {
+		return print_usage();
+	}
 
-	// start packet processing loop, just like live capture
-	if (pcap_loop(h, 0, p.handler_wrapper, reinterpret_cast<unsigned char*>(&p)) < 0) {
-		std::cerr << "pcap_loop() failed: " << pcap_geterr(h);
+	++argv;
+	--argc;
+
+	using namespace std::literals::string_literals;
+
+	int threads = 1;
+	std::int64_t idle_timeout = 600;
+	std::string binary_log;
+	std::string summary;
+	std::string latency;
+	std::string profile;
+	std::string rates;
+	rate_format rates_format = rate_format::csv;
+	bool segmented = false;
+	bool materialize = false;
+	format_options opts;
+	flow_filter filter;
+
+	while (argc > 1) {
+		if (argv[0] == "--help"s) {
+			print_usage();
+			return 0;
+		}
+		if (argv[0] == "--threads"s && argc > 2) {
+			threads = std::max(1, atoi(argv[1]));
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--idle-timeout"s && argc > 2) {
+			idle_timeout = std::max(0ll, atoll(argv[1]));
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--bitfield"s && argc > 2) {
+			if (!parse_bitfield_format(argv[1], opts.bitfield)) {
+				std::cerr << "unknown bitfield format: " << argv[1] << '\n';
+				return 1;
+			}
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--segments"s) {
+			segmented = true;
+		}
+		else if (argv[0] == "--materialize"s) {
+			segmented = true;
+			materialize = true;
+		}
+		else if (argv[0] == "--info-hash"s && argc > 2) {
+			if (!filter.add_info_hash(argv[1])) {
+				std::cerr << "invalid info-hash: " << argv[1] << '\n';
+				return 1;
+			}
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--peer"s && argc > 2) {
+			if (!filter.add_peer(argv[1])) {
+				std::cerr << "invalid subnet: " << argv[1] << '\n';
+				return 1;
+			}
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--binary-log"s && argc > 2) {
+			binary_log = argv[1];
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--summary"s && argc > 2) {
+			summary = argv[1];
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--latency"s && argc > 2) {
+			latency = argv[1];
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--queue-profile"s && argc > 2) {
+			profile = argv[1];
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--rates"s && argc > 2) {
+			rates = argv[1];
+			++argv;
+			--argc;
+		}
+		else if (argv[0] == "--rates-format"s && argc > 2) {
+			if (!parse_rate_format(argv[1], rates_format)) {
+				std::cerr << "unknown rates format: " << argv[1] << '\n';
+				return 1;
+			}
+			++argv;
+			--argc;
+		}
+		else {
+			std::cerr << "unknown option: " << argv[0] << '\n';
+			return 1;
+		}
+
+		++argv;
+		--argc;
+	}
+
+	if (segmented && !binary_log.empty()) {
+		std::cerr << "--binary-log can't be combined with --segments\n";
 		return 1;
 	}
+	if (!summary.empty() && (segmented || !binary_log.empty())) {
+		std::cerr << "--summary can't be combined with --binary-log or --segments\n";
+		return 1;
+	}
+
+	capture_reader reader(argv[0]);
+	capture_stats st;
+	processor_stats pst;
+
+	// all files are written by this thread
+	async_writer writer;
+	text_sink text(writer, opts);
+	std::unique_ptr<binary_sink> binary;
+	if (!binary_log.empty()) binary = std::make_unique<binary_sink>(binary_log, writer);
+	std::unique_ptr<segment_sink> segments;
+	if (segmented) segments = std::make_unique<segment_sink>(writer);
+	std::unique_ptr<summary_sink> summaries;
+	if (!summary.empty()) summaries = std::make_unique<summary_sink>(summary, writer);
+	event_sink* const sink = binary ? static_cast<event_sink*>(binary.get())
+		: segments ? static_cast<event_sink*>(segments.get())
+		: summaries ? static_cast<event_sink*>(summaries.get())
+		: &text;
+	std::unique_ptr<latency_log> latencies;
+	if (!latency.empty()) latencies = std::make_unique<latency_log>(latency, writer);
+	std::unique_ptr<queue_log> queues;
+	if (!profile.empty()) queues = std::make_unique<queue_log>(profile, writer);
+	std::unique_ptr<rate_log> rate_curves;
+	if (!rates.empty()) rate_curves = std::make_unique<rate_log>(rates, rates_format, writer);
+	stats_logs logs;
+	logs.latency = latencies.get();
+	logs.queue = queues.get();
+	logs.rates = rate_curves.get();
+
+	if (threads > 1) {
+		std::mutex m;
+		st = process_parallel<processor<parse_bittorrent>>(reader, threads
+			, [&](processor<parse_bittorrent> const& p)
+			{
+				std::lock_guard<std::mutex> l(m);
+				pst += p.stats();
+			}, idle_timeout, sink, &filter, &logs);
+	}
+	else {
+//		processor<logger> p;
+		processor<parse_bittorrent> p(idle_timeout, sink, &filter, &logs);
+
+		std::uint64_t index = 0;
+		st = reader.read([&p, &index](timeval const& ts, span<unsigned char const> pkt)
+			{ p.process(ts, pkt, index++); });
+		pst = p.stats();
+	}
 
+	// all streams have been closed by now, write the index
+	if (binary) binary->close();
+	if (segments) segments->close();
+	if (summaries) summaries->close();
+	if (latencies) latencies->close();
+	writer.close();
+	writer_stats const wst = writer.stats();
+	writer_stats mst;
+
+	if (materialize) {
+		// one segment at a time, each stream's file is written in one go
+		async_writer text_writer;
+		text_sink materialized(text_writer, opts);
+		for (auto const& path : segments->segments()) {
+			{
+				binary_log_reader const log(path.c_str());
+				for (auto const& ih : log.info_hashes()) replay(log, ih, materialized);
+			}
+			::unlink(path.c_str());
+		}
+		text_writer.close();
+		mst = text_writer.stats();
+	}
+
+	std::cerr << st << '\n' << pst << '\n' << wst << '\n';
+	if (materialize) std::cerr << "materialize: " << mst << '\n';
 	return 0;
 }
 catch (std::exception const& e)
 {
 	std::cerr << "failed: " << e.what() << '\n';
+	return 1;
 }
-
-
@@ -0,0 +1,98 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <cstddef>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "span.hpp"
+
+using libtorrent::span;
+
+// a read-only memory mapping of an entire file. The kernel is told we'll read
+// it front to back, so it can read ahead aggressively.
+struct mapped_file
+{
+	explicit mapped_file(char const* filename)
+	{
+		int const fd = ::open(filename, O_RDONLY);
+		if (fd < 0) return;
+
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			::close(fd);
+			return;
+		}
+
+		void* const ptr = ::mmap(nullptr, std::size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// the mapping keeps the file alive, we don't need the descriptor anymore
+		::close(fd);
+		if (ptr == MAP_FAILED) return;
+
+		::madvise(ptr, std::size_t(st.st_size), MADV_SEQUENTIAL);
+		m_data = static_cast<unsigned char const*>(ptr);
+		m_size = std::size_t(st.st_size);
+	}
+
+	mapped_file(mapped_file const&) = delete;
+	mapped_file& operator=(mapped_file const&) = delete;
+
+	~mapped_file()
+	{
+		if (m_data) ::munmap(const_cast<unsigned char*>(m_data), m_size);
+	}
+
+	bool is_open() const { return m_data != nullptr; }
+	span<unsigned char const> data() const { return {m_data, std::ptrdiff_t(m_size)}; }
+
+	// tell the kernel we won't look at the pages before "offset" again. The
+	// mapping is read-only and backed by the file, so any span into it remains
+	// valid, touching it again just means the page is read back from disk.
+	void release(std::size_t const offset)
+	{
+		std::size_t const page = std::size_t(::sysconf(_SC_PAGESIZE));
+		std::size_t const end = offset / page * page;
+		if (end <= m_released) return;
+		::madvise(const_cast<unsigned char*>(m_data) + m_released, end - m_released, MADV_DONTNEED);
+		m_released = end;
+	}
+
+private:
+	unsigned char const* m_data = nullptr;
+	std::size_t m_size = 0;
+	std::size_t m_released = 0;
+};
@@ -0,0 +1,291 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// the subsystems allocating from the payload arena. Memory is accounted for
+// separately for each of them
+enum class arena_tag : std::uint8_t
+{
+	tcp_reassembly,
+	utp_reorder,
+	ip_fragments,
+	bittorrent,
+};
+
+constexpr int num_arena_tags = 4;
+
+inline char const* arena_tag_name(arena_tag const t)
+{
+	switch (t) {
+		case arena_tag::tcp_reassembly: return "TCP reassembly";
+		case arena_tag::utp_reorder: return "uTP reorder";
+		case arena_tag::ip_fragments: return "IP fragments";
+		case arena_tag::bittorrent: return "bittorrent";
+	}
+	return "??";
+}
+
+struct arena_stats
+{
+	// bytes currently handed out to each subsystem, and the most it has held at
+	// any one time
+	std::array<std::uint64_t, num_arena_tags> held{};
+	std::array<std::uint64_t, num_arena_tags> peak{};
+
+	// bytes allocated from the system, slabs as well as allocations too large
+	// for any size class
+	std::uint64_t reserved = 0;
+	std::uint64_t reserved_peak = 0;
+
+	// the peaks of different arenas may not have happened at the same time,
+	// summing them is an upper bound
+	arena_stats& operator+=(arena_stats const& rhs)
+	{
+		for (int i = 0; i < num_arena_tags; ++i) {
+			held[i] += rhs.held[i];
+			peak[i] += rhs.peak[i];
+		}
+		reserved += rhs.reserved;
+		reserved_peak += rhs.reserved_peak;
+		return *this;
+	}
+
+	friend std::ostream& operator<<(std::ostream& os, arena_stats const& st)
+	{
+		os << "payload memory held (peak):";
+		for (int i = 0; i < num_arena_tags; ++i) {
+			os << ' ' << arena_tag_name(arena_tag(i)) << ": " << st.held[i]
+				<< " (" << st.peak[i] << ") B,";
+		}
+		return os << " reserved: " << st.reserved << " (" << st.reserved_peak << ") B";
+	}
+};
+
+// allocates packet payload. Requests are rounded up to one of a handful of size
+// classes, tuned for MTU sized packets, and carved out of large slabs. Freed
+// chunks are kept on a free list per size class, and slabs are only returned
+// to the system when the arena is destroyed. Requests larger than the largest
+// size class go straight to operator new.
+//
+// An arena is not thread safe. Each thread has its own, returned by local(),
+// which means memory must be freed by the thread that allocated it.
+struct payload_arena
+{
+	payload_arena() = default;
+	payload_arena(payload_arena const&) = delete;
+	payload_arena& operator=(payload_arena const&) = delete;
+
+	~payload_arena()
+	{
+		for (void* s : m_slabs) ::operator delete(s);
+	}
+
+	// "bytes" must be passed to deallocate() as well
+	void* allocate(std::size_t const bytes, arena_tag const tag)
+	{
+		int const c = size_class(bytes);
+		if (c < 0) {
+			account(tag, std::int64_t(bytes));
+			reserve(std::int64_t(bytes));
+			return ::operator new(bytes);
+		}
+		account(tag, std::int64_t(class_size(c)));
+		if (m_free[std::size_t(c)] == nullptr) refill(c);
+		free_chunk* ret = m_free[std::size_t(c)];
+		m_free[std::size_t(c)] = ret->next;
+		return ret;
+	}
+
+	void deallocate(void* const p, std::size_t const bytes, arena_tag const tag)
+	{
+		if (p == nullptr) return;
+		int const c = size_class(bytes);
+		if (c < 0) {
+			account(tag, -std::int64_t(bytes));
+			reserve(-std::int64_t(bytes));
+			::operator delete(p);
+			return;
+		}
+		account(tag, -std::int64_t(class_size(c)));
+		auto* chunk = static_cast<free_chunk*>(p);
+		chunk->next = m_free[std::size_t(c)];
+		m_free[std::size_t(c)] = chunk;
+	}
+
+	arena_stats const& stats() const { return m_stats; }
+
+	// the arena of the calling thread
+	static payload_arena& local()
+	{
+		thread_local payload_arena arena;
+		return arena;
+	}
+
+private:
+
+	struct free_chunk
+	{
+		free_chunk* next;
+	};
+
+	static constexpr std::size_t slab_size = 256 * 1024;
+	static constexpr int num_classes = 12;
+
+	static constexpr std::size_t class_size(int const c)
+	{
+		constexpr std::size_t sizes[num_classes] = {
+			64, 128, 256, 512, 1024, 1536, 2048, 4096, 8192, 16384, 32768, 65536 };
+		return sizes[c];
+	}
+
+	// returns -1 if the request is too large for any size class
+	static int size_class(std::size_t const bytes)
+	{
+		for (int c = 0; c < num_classes; ++c) {
+			if (bytes <= class_size(c)) return c;
+		}
+		return -1;
+	}
+
+	void refill(int const c)
+	{
+		std::size_t const size = class_size(c);
+		auto* slab = static_cast<char*>(::operator new(slab_size));
+		m_slabs.push_back(slab);
+		reserve(std::int64_t(slab_size));
+		for (std::size_t i = slab_size / size; i > 0; --i) {
+			auto* chunk = reinterpret_cast<free_chunk*>(slab + (i - 1) * size);
+			chunk->next = m_free[std::size_t(c)];
+			m_free[std::size_t(c)] = chunk;
+		}
+	}
+
+	void account(arena_tag const tag, std::int64_t const delta)
+	{
+		auto& held = m_stats.held[std::size_t(tag)];
+		held = std::uint64_t(std::int64_t(held) + delta);
+		auto& peak = m_stats.peak[std::size_t(tag)];
+		if (held > peak) peak = held;
+	}
+
+	void reserve(std::int64_t const delta)
+	{
+		m_stats.reserved = std::uint64_t(std::int64_t(m_stats.reserved) + delta);
+		if (m_stats.reserved > m_stats.reserved_peak) m_stats.reserved_peak = m_stats.reserved;
+	}
+
+	std::array<free_chunk*, num_classes> m_free{};
+	std::vector<void*> m_slabs;
+	arena_stats m_stats;
+};
+
+// a standard allocator drawing from the calling thread's payload arena,
+// accounting everything to "Tag"
+template <typename T, arena_tag Tag>
+struct arena_allocator
+{
+	using value_type = T;
+
+	template <typename U>
+	struct rebind { using other = arena_allocator<U, Tag>; };
+
+	arena_allocator() = default;
+	template <typename U>
+	arena_allocator(arena_allocator<U, Tag> const&) noexcept {}
+
+	T* allocate(std::size_t const n)
+	{
+		return static_cast<T*>(payload_arena::local().allocate(n * sizeof(T), Tag));
+	}
+
+	void deallocate(T* const p, std::size_t const n)
+	{
+		payload_arena::local().deallocate(p, n * sizeof(T), Tag);
+	}
+
+	template <typename U>
+	friend bool operator==(arena_allocator const&, arena_allocator<U, Tag> const&) { return true; }
+	template <typename U>
+	friend bool operator!=(arena_allocator const&, arena_allocator<U, Tag> const&) { return false; }
+};
+
+// a fixed size buffer of bytes from the calling thread's payload arena
+template <arena_tag Tag>
+struct arena_buffer
+{
+	arena_buffer() = default;
+	explicit arena_buffer(std::size_t const size)
+		: m_data(static_cast<unsigned char*>(payload_arena::local().allocate(size, Tag)))
+		, m_size(size)
+	{}
+
+	arena_buffer(arena_buffer&& rhs) noexcept
+		: m_data(std::exchange(rhs.m_data, nullptr))
+		, m_size(std::exchange(rhs.m_size, 0))
+	{}
+
+	arena_buffer& operator=(arena_buffer&& rhs) noexcept
+	{
+		if (this == &rhs) return *this;
+		reset();
+		m_data = std::exchange(rhs.m_data, nullptr);
+		m_size = std::exchange(rhs.m_size, 0);
+		return *this;
+	}
+
+	~arena_buffer() { reset(); }
+
+	void reset()
+	{
+		if (m_data == nullptr) return;
+		payload_arena::local().deallocate(m_data, m_size, Tag);
+		m_data = nullptr;
+		m_size = 0;
+	}
+
+	unsigned char* data() const { return m_data; }
+	std::size_t size() const { return m_size; }
+	explicit operator bool() const { return m_data != nullptr; }
+
+private:
+	unsigned char* m_data = nullptr;
+	std::size_t m_size = 0;
+};
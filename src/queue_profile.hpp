@@ -0,0 +1,269 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "array.hpp"
+#include "bt_event.hpp"
+#include "async_writer.hpp"
+#include "format.hpp"
+
+// the requests waiting for an answer in one direction of a connection
+struct queue_depth
+{
+	std::uint32_t requests;
+	std::uint64_t bytes;
+};
+
+// the pipeline profiles of connections are written to three CSV files as
+// they're collected:
+//
+//   <prefix>.csv          the largest number of outstanding requests (and
+//                         bytes) in each direction, per one second bin. Bins
+//                         with nothing outstanding are left out
+//   <prefix>-starved.csv  the intervals where the queue of a direction was
+//                         empty while the peer would have served requests
+//                         (we were unchoked and interested)
+//   <prefix>-flows.csv    one row per connection, as it closes
+//
+// Connections are identified by their flow ID. Rows of different connections
+// are interleaved, in no particular order. Profiles may be written from any
+// number of threads
+struct queue_log
+{
+	// the width of the time bins, in microseconds
+	static constexpr std::int64_t bin_width = 1000000;
+
+	queue_log(std::string const& prefix, async_writer& w)
+		: m_writer(w)
+		, m_profile(w.add_file(prefix + ".csv", true))
+		, m_starved(w.add_file(prefix + "-starved.csv"))
+		, m_flows(w.add_file(prefix + "-flows.csv"))
+	{
+		text_buffer buf;
+		append(buf, "flow,time,requests_in,bytes_in,requests_out,bytes_out\n");
+		write_profile(buf);
+		append(buf, "flow,dir,start,end,duration_ms\n");
+		write_starved(buf);
+		append(buf, "flow,info_hash,src,src_port,dst,dst_port,peak_requests_in,peak_requests_out"
+			",peak_bytes_in,peak_bytes_out,starved_in,starved_out,starved_ms_in,starved_ms_out\n");
+		write_flow(buf);
+	}
+
+	queue_log(queue_log const&) = delete;
+	queue_log& operator=(queue_log const&) = delete;
+
+	// these hand complete rows to the writer. "buf" is swapped with an empty
+	// buffer
+	void write_profile(text_buffer& buf) { m_writer.write(m_profile, async_writer::append, buf); }
+	void write_starved(text_buffer& buf) { m_writer.write(m_starved, async_writer::append, buf); }
+	void write_flow(text_buffer& buf) { m_writer.write(m_flows, async_writer::append, buf); }
+
+private:
+	async_writer& m_writer;
+	std::uint32_t const m_profile;
+	std::uint32_t const m_starved;
+	std::uint32_t const m_flows;
+};
+
+// samples the queue depth of both directions of a connection into bins of
+// queue_log::bin_width. The bins are kept in a preallocated ring, which is
+// formatted and handed to the log whenever it fills up (and as the connection
+// closes)
+struct queue_profile
+{
+	queue_profile(queue_log& log, flow_info const& f)
+		: m_log(log)
+		, m_flow(f)
+	{
+		m_starved_since[dir_t::in] = -1;
+		m_starved_since[dir_t::out] = -1;
+	}
+
+	queue_profile(queue_profile const&) = delete;
+	queue_profile& operator=(queue_profile const&) = delete;
+
+	// the queue of direction "d" is now "depth", at "ts". "serving" is true if
+	// the peer would answer requests sent in this direction
+	void sample(std::int64_t const ts, dir_t const d, queue_depth const depth, bool const serving)
+	{
+		advance(ts);
+		m_depth[d] = depth;
+		auto& peak = m_current[d];
+		peak.requests = std::max(peak.requests, depth.requests);
+		peak.bytes = std::max(peak.bytes, depth.bytes);
+		m_peak[d].requests = std::max(m_peak[d].requests, depth.requests);
+		m_peak[d].bytes = std::max(m_peak[d].bytes, depth.bytes);
+
+		bool const starved = serving && depth.requests == 0;
+		auto& since = m_starved_since[d];
+		if (starved && since < 0) since = ts;
+		else if (!starved && since >= 0) end_starvation(d, ts);
+	}
+
+	// flushes the remaining bins and writes the summary of the connection.
+	// Intervals still going on end at "end", the time the connection was torn
+	// down (or at the last sample, if that's later)
+	void close(std::int64_t const end)
+	{
+		if (m_bin < 0) return;
+		push(m_bin, m_current);
+		for (dir_t const d : {dir_t::in, dir_t::out})
+			if (m_starved_since[d] >= 0) end_starvation(d, std::max(end, m_last));
+		flush();
+
+		text_buffer buf;
+		append_int(buf, m_flow.flow_id);
+		append(buf, ',');
+		append_hex(buf, m_flow.info_hash);
+		append(buf, ',');
+		append_address(buf, m_flow.key.src);
+		append(buf, ',');
+		append_int(buf, m_flow.key.src_port);
+		append(buf, ',');
+		append_address(buf, m_flow.key.dst);
+		append(buf, ',');
+		append_int(buf, m_flow.key.dst_port);
+		for (auto const& p : m_peak) { append(buf, ','); append_int(buf, p.requests); }
+		for (auto const& p : m_peak) { append(buf, ','); append_int(buf, p.bytes); }
+		for (auto const n : m_starved_count) { append(buf, ','); append_int(buf, n); }
+		for (auto const t : m_starved_time) { append(buf, ','); append_int(buf, t / 1000); }
+		append(buf, '\n');
+		m_log.write_flow(buf);
+		m_bin = -1;
+	}
+
+	~queue_profile() { close(m_last); }
+
+private:
+
+	// the bins in the ring before it's flushed
+	static constexpr std::size_t ring_size = 128;
+	// an idle connection with requests outstanding carries its queue depth
+	// into the bins it's idle for, but for no longer than this (in case the
+	// capture's clock jumps)
+	static constexpr std::int64_t max_carried_bins = 24 * 60 * 60;
+
+	struct bin
+	{
+		std::int64_t index;
+		array<queue_depth, 2, dir_t> depth;
+	};
+
+	// closes the bins before the one "ts" falls in
+	void advance(std::int64_t const ts)
+	{
+		std::int64_t const b = ts / queue_log::bin_width;
+		if (ts > m_last) m_last = ts;
+		if (m_bin < 0) {
+			m_bin = b;
+			return;
+		}
+		if (b <= m_bin) return;
+		push(m_bin, m_current);
+		std::int64_t const carried = std::min(b, m_bin + 1 + max_carried_bins);
+		for (std::int64_t i = m_bin + 1; i < carried; ++i) push(i, m_depth);
+		m_bin = b;
+		m_current = m_depth;
+	}
+
+	void push(std::int64_t const index, array<queue_depth, 2, dir_t> const& depth)
+	{
+		if (depth[dir_t::in].requests == 0 && depth[dir_t::out].requests == 0) return;
+		if (m_ring.capacity() < ring_size) m_ring.reserve(ring_size);
+		m_ring.push_back(bin{index, depth});
+		if (m_ring.size() == ring_size) flush();
+	}
+
+	void flush()
+	{
+		if (m_ring.empty()) return;
+		text_buffer buf;
+		for (auto const& b : m_ring) {
+			append_int(buf, m_flow.flow_id);
+			append(buf, ',');
+			append_timestamp(buf, to_timeval(b.index * queue_log::bin_width));
+			for (auto const& d : b.depth) {
+				append(buf, ',');
+				append_int(buf, d.requests);
+				append(buf, ',');
+				append_int(buf, d.bytes);
+			}
+			append(buf, '\n');
+		}
+		m_log.write_profile(buf);
+		m_ring.clear();
+	}
+
+	void end_starvation(dir_t const d, std::int64_t const ts)
+	{
+		std::int64_t const start = m_starved_since[d];
+		m_starved_since[d] = -1;
+		if (ts <= start) return;
+		++m_starved_count[d];
+		m_starved_time[d] += ts - start;
+
+		text_buffer buf;
+		append_int(buf, m_flow.flow_id);
+		append(buf, d == dir_t::in ? ",in," : ",out,");
+		append_timestamp(buf, to_timeval(start));
+		append(buf, ',');
+		append_timestamp(buf, to_timeval(ts));
+		append(buf, ',');
+		append_int(buf, (ts - start) / 1000);
+		append(buf, '\n');
+		m_log.write_starved(buf);
+	}
+
+	queue_log& m_log;
+	flow_info m_flow;
+
+	// the bin samples currently go into, or -1 before the first sample
+	std::int64_t m_bin = -1;
+	std::int64_t m_last = 0;
+	// the largest depth seen in the current bin
+	array<queue_depth, 2, dir_t> m_current{};
+	array<queue_depth, 2, dir_t> m_depth{};
+	array<queue_depth, 2, dir_t> m_peak{};
+	std::vector<bin> m_ring;
+
+	// when the current interval of an empty queue started, or -1
+	array<std::int64_t, 2, dir_t> m_starved_since;
+	array<std::uint32_t, 2, dir_t> m_starved_count{};
+	array<std::int64_t, 2, dir_t> m_starved_time{};
+};
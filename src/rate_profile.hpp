@@ -0,0 +1,291 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "array.hpp"
+#include "bt_event.hpp"
+#include "async_writer.hpp"
+#include "format.hpp"
+
+enum class rate_format : std::uint8_t { csv, binary };
+
+inline bool parse_rate_format(std::string_view const name, rate_format& f)
+{
+	if (name == "csv") f = rate_format::csv;
+	else if (name == "binary") f = rate_format::binary;
+	else return false;
+	return true;
+}
+
+// the bytes received in each direction of a stream, in one time bin. The
+// binary rate file is a rate_header followed by these records (with no
+// particular order between streams, but in order within one). Bins where
+// nothing was received are left out. All integers are in host byte order.
+struct rate_record
+{
+	std::uint64_t flow_id;
+	// microseconds since the epoch, of the start of the bin
+	std::int64_t time;
+	// TCP or uTP payload of every packet, including retransmissions and
+	// packets of a direction the parser has given up on (after a sequence
+	// number mismatch). Indexed by dir_t
+	std::array<std::uint32_t, 2> transport;
+	// the blocks of PIECE messages with a valid length
+	std::array<std::uint32_t, 2> payload;
+};
+
+constexpr char rate_magic[8] = {'T', 'B', 'T', 'R', 'A', 'T', 'E', '1'};
+constexpr std::uint32_t rate_version = 1;
+
+struct rate_header
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t record_size;
+	// microseconds
+	std::int64_t bin_width;
+	std::uint8_t reserved[8];
+};
+
+static_assert(sizeof(rate_record) == 32, "rate_record is expected to be 32 bytes");
+static_assert(sizeof(rate_header) == sizeof(rate_record), "the header is expected to keep records aligned");
+
+// where the rate curves of streams go. As CSV, to <prefix>.csv, or in the
+// binary format above, to <prefix>.bin. Either way, a row per stream (with its
+// endpoints, info-hash and totals) is written to <prefix>-flows.csv as it
+// closes. Rates may be written from any number of threads
+struct rate_log
+{
+	// the width of the time bins, in microseconds
+	static constexpr std::int64_t bin_width = 100000;
+
+	rate_log(std::string const& prefix, rate_format const fmt, async_writer& w)
+		: m_writer(w)
+		, m_format(fmt)
+		, m_rates(w.add_file(prefix + (fmt == rate_format::csv ? ".csv" : ".bin")))
+		, m_flows(w.add_file(prefix + "-flows.csv", true))
+	{
+		std::vector<char> buf;
+		if (fmt == rate_format::csv) {
+			append(buf, "flow,time,transport_in,transport_out,payload_in,payload_out\n");
+		}
+		else {
+			rate_header hdr{};
+			std::memcpy(hdr.magic, rate_magic, sizeof(hdr.magic));
+			hdr.version = rate_version;
+			hdr.record_size = sizeof(rate_record);
+			hdr.bin_width = bin_width;
+			auto const* ptr = reinterpret_cast<char const*>(&hdr);
+			buf.assign(ptr, ptr + sizeof(hdr));
+		}
+		m_writer.write(m_rates, async_writer::append, buf);
+		append(buf, "flow,info_hash,src,src_port,dst,dst_port,first,last"
+			",transport_in,transport_out,payload_in,payload_out\n");
+		m_writer.write(m_flows, async_writer::append, buf);
+	}
+
+	rate_log(rate_log const&) = delete;
+	rate_log& operator=(rate_log const&) = delete;
+
+	rate_format format() const { return m_format; }
+
+	// these hand complete rows (or records) to the writer. "buf" is swapped
+	// with an empty buffer
+	void write_rates(std::vector<char>& buf) { m_writer.write(m_rates, async_writer::append, buf); }
+	void write_flow(text_buffer& buf) { m_writer.write(m_flows, async_writer::append, buf); }
+
+private:
+	async_writer& m_writer;
+	rate_format const m_format;
+	std::uint32_t const m_rates;
+	std::uint32_t const m_flows;
+};
+
+// counts the bytes of a stream into bins of rate_log::bin_width. The bins are
+// kept in a fixed array, which is written to the log whenever it fills up
+// (and as the stream closes). Bytes are counted from the first packet, but
+// nothing is written unless the stream turns out to be one we follow. The
+// totals only count the bins that are written, so they add up to the curve
+struct rate_profile
+{
+	rate_profile(rate_log& log, std::uint64_t const flow_id)
+		: m_log(log)
+	{
+		m_flow.flow_id = flow_id;
+		m_current.flow_id = flow_id;
+	}
+
+	rate_profile(rate_profile const&) = delete;
+	rate_profile& operator=(rate_profile const&) = delete;
+
+	~rate_profile()
+	{
+		if (!m_followed) return;
+		next_bin();
+		flush();
+
+		text_buffer buf;
+		append_int(buf, m_flow.flow_id);
+		append(buf, ',');
+		append_hex(buf, m_flow.info_hash);
+		append(buf, ',');
+		append_address(buf, m_flow.key.src);
+		append(buf, ',');
+		append_int(buf, m_flow.key.src_port);
+		append(buf, ',');
+		append_address(buf, m_flow.key.dst);
+		append(buf, ',');
+		append_int(buf, m_flow.key.dst_port);
+		append(buf, ',');
+		append_timestamp(buf, to_timeval(m_first));
+		append(buf, ',');
+		append_timestamp(buf, to_timeval(m_last));
+		for (auto const& t : {m_transport, m_payload}) {
+			for (auto const n : t) {
+				append(buf, ',');
+				append_int(buf, n);
+			}
+		}
+		append(buf, '\n');
+		m_log.write_flow(buf);
+	}
+
+	// the stream is one we follow, its rates will be logged
+	void follow(flow_info const& f)
+	{
+		m_flow = f;
+		m_followed = true;
+	}
+
+	// "n" bytes of TCP or uTP payload arrived in direction "d"
+	void transport(std::int64_t const ts, dir_t const d, std::uint32_t const n)
+	{
+		advance(ts);
+		m_current.transport[std::size_t(d)] += n;
+	}
+
+	// "n" bytes of PIECE blocks arrived in direction "d"
+	void payload(std::int64_t const ts, dir_t const d, std::uint32_t const n)
+	{
+		advance(ts);
+		m_current.payload[std::size_t(d)] += n;
+	}
+
+private:
+
+	// the bins in the array before it's written
+	static constexpr std::size_t num_bins = 64;
+
+	void advance(std::int64_t const ts)
+	{
+		if (ts > m_last) m_last = ts;
+		std::int64_t const b = ts / rate_log::bin_width * rate_log::bin_width;
+		if (b > m_current.time) {
+			next_bin();
+			m_current.time = b;
+		}
+		// set after next_bin(), which may have dropped the bins so far
+		if (m_first == 0) m_first = ts;
+	}
+
+	void next_bin()
+	{
+		auto const& c = m_current;
+		if (c.transport[0] == 0 && c.transport[1] == 0 && c.payload[0] == 0 && c.payload[1] == 0)
+			return;
+		m_bins[m_size++] = c;
+		m_current = rate_record{m_flow.flow_id, c.time, {}, {}};
+		if (m_size == num_bins) flush();
+	}
+
+	void flush()
+	{
+		// the stream may not have got as far as the handshake yet. If it takes
+		// this long, it's unlikely to be BitTorrent. The bins are dropped, and
+		// the stream is timed from the next packet
+		if (!m_followed || m_size == 0) {
+			if (!m_followed) m_first = 0;
+			m_size = 0;
+			return;
+		}
+
+		for (std::size_t i = 0; i < m_size; ++i) {
+			for (dir_t const d : {dir_t::in, dir_t::out}) {
+				m_transport[d] += m_bins[i].transport[std::size_t(d)];
+				m_payload[d] += m_bins[i].payload[std::size_t(d)];
+			}
+		}
+
+		std::vector<char> buf;
+		if (m_log.format() == rate_format::binary) {
+			auto const* ptr = reinterpret_cast<char const*>(m_bins.data());
+			buf.assign(ptr, ptr + m_size * sizeof(rate_record));
+		}
+		else {
+			for (std::size_t i = 0; i < m_size; ++i) {
+				auto const& b = m_bins[i];
+				append_int(buf, m_flow.flow_id);
+				append(buf, ',');
+				append_timestamp(buf, to_timeval(b.time));
+				for (auto const& t : {b.transport, b.payload}) {
+					for (auto const n : t) {
+						append(buf, ',');
+						append_int(buf, n);
+					}
+				}
+				append(buf, '\n');
+			}
+		}
+		m_log.write_rates(buf);
+		m_size = 0;
+	}
+
+	rate_log& m_log;
+	flow_info m_flow{};
+	bool m_followed = false;
+
+	std::int64_t m_first = 0;
+	std::int64_t m_last = 0;
+	array<std::uint64_t, 2, dir_t> m_transport{};
+	array<std::uint64_t, 2, dir_t> m_payload{};
+
+	rate_record m_current{};
+	std::array<rate_record, num_bins> m_bins;
+	std::size_t m_size = 0;
+};
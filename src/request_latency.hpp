@@ -0,0 +1,280 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bt_event.hpp"
+#include "async_writer.hpp"
+#include "format.hpp"
+
+// a log-linear (HDR style) histogram of latencies, in microseconds. Values
+// below 16 get a bucket each. Above that, every power of two is split into 16
+// buckets, so a value is never more than 1/16 (6%) below the upper bound of
+// its bucket. The buckets are allocated as they're needed.
+struct latency_histogram
+{
+	static constexpr int sub_bits = 4;
+
+	static int bucket(std::uint64_t const v)
+	{
+		if (v < (1u << sub_bits)) return int(v);
+		int const shift = 63 - __builtin_clzll(v) - sub_bits;
+		return ((shift + 1) << sub_bits) + int((v >> shift) & ((1u << sub_bits) - 1));
+	}
+
+	// the smallest value in bucket "b"
+	static std::uint64_t lower_bound(int const b)
+	{
+		if (b < (1 << sub_bits)) return std::uint64_t(b);
+		int const shift = (b >> sub_bits) - 1;
+		return std::uint64_t((1 << sub_bits) | (b & ((1 << sub_bits) - 1))) << shift;
+	}
+
+	// the largest value in bucket "b"
+	static std::uint64_t upper_bound(int const b) { return lower_bound(b + 1) - 1; }
+
+	void add(std::int64_t const latency)
+	{
+		std::uint64_t const v = std::uint64_t(std::max(std::int64_t(0), latency));
+		std::size_t const b = std::size_t(bucket(v));
+		if (b >= m_counts.size()) m_counts.resize(b + 1, 0);
+		++m_counts[b];
+		++m_total;
+		m_max = std::max(m_max, v);
+	}
+
+	void merge(latency_histogram const& h)
+	{
+		if (h.m_counts.size() > m_counts.size()) m_counts.resize(h.m_counts.size(), 0);
+		for (std::size_t i = 0; i < h.m_counts.size(); ++i) m_counts[i] += h.m_counts[i];
+		m_total += h.m_total;
+		m_max = std::max(m_max, h.m_max);
+	}
+
+	// the upper bound of the bucket holding the value "q" (0-1) of the way
+	// into the sorted samples. The largest sample is exact
+	std::uint64_t quantile(double const q) const
+	{
+		if (m_total == 0) return 0;
+		std::uint64_t const rank = std::max(std::uint64_t(1), std::uint64_t(q * double(m_total) + 0.5));
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < m_counts.size(); ++i) {
+			seen += m_counts[i];
+			if (seen >= rank) return std::min(upper_bound(int(i)), m_max);
+		}
+		return m_max;
+	}
+
+	std::uint64_t count() const { return m_total; }
+	std::uint64_t max() const { return m_max; }
+	std::vector<std::uint64_t> const& buckets() const { return m_counts; }
+
+private:
+	std::vector<std::uint64_t> m_counts;
+	std::uint64_t m_total = 0;
+	std::uint64_t m_max = 0;
+};
+
+// what happened to the requests sent in one direction of a connection
+struct request_stats
+{
+	std::uint64_t requests = 0;
+	// answered by a PIECE message. Their latency is in "latency"
+	std::uint64_t served = 0;
+	std::uint64_t cancelled = 0;
+	std::uint64_t rejected = 0;
+	// discarded by the peer choking us (without the fast extension)
+	std::uint64_t choked = 0;
+	// PIECE messages answering none of them
+	std::uint64_t unrequested = 0;
+	// still waiting for an answer as the connection closed
+	std::uint64_t outstanding = 0;
+	latency_histogram latency;
+
+	void merge(request_stats const& s)
+	{
+		requests += s.requests;
+		served += s.served;
+		cancelled += s.cancelled;
+		rejected += s.rejected;
+		choked += s.choked;
+		unrequested += s.unrequested;
+		outstanding += s.outstanding;
+		latency.merge(s.latency);
+	}
+};
+
+// collects the request latencies of connections as they close. close() writes
+// them, one row per connection and direction with requests in it, as CSV to
+// "<prefix>.csv", and the same summed up per torrent to
+// "<prefix>-torrents.csv". Connections may be added from any number of
+// threads
+struct latency_log
+{
+	latency_log(std::string const& prefix, async_writer& w)
+		: m_writer(w)
+		, m_flows_csv(w.add_file(prefix + ".csv", true))
+		, m_torrents_csv(w.add_file(prefix + "-torrents.csv"))
+	{}
+
+	latency_log(latency_log const&) = delete;
+	latency_log& operator=(latency_log const&) = delete;
+
+	~latency_log() { close(); }
+
+	// the requests sent in each direction of a connection, indexed by dir_t
+	void add(flow_info const& f, std::array<request_stats, 2> stats)
+	{
+		if (stats[0].requests == 0 && stats[1].requests == 0
+			&& stats[0].unrequested == 0 && stats[1].unrequested == 0)
+			return;
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_flows.push_back(flow{f, std::move(stats)});
+	}
+
+	// hands the tables to the writer. All connections must have been added by
+	// now. The files are complete once the writer is closed
+	void close()
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		if (m_closed) return;
+		m_closed = true;
+
+		std::sort(m_flows.begin(), m_flows.end(), [](flow const& lhs, flow const& rhs)
+		{
+			if (lhs.info.info_hash != rhs.info.info_hash) return lhs.info.info_hash < rhs.info.info_hash;
+			return lhs.info.flow_id < rhs.info.flow_id;
+		});
+
+		text_buffer out;
+		append(out, "flow,info_hash,src,src_port,dst,dst_port,dir");
+		append_header(out);
+		for (auto const& f : m_flows) {
+			for (int d = 0; d < 2; ++d) {
+				if (f.stats[d].requests == 0 && f.stats[d].unrequested == 0) continue;
+				append_int(out, f.info.flow_id);
+				append(out, ',');
+				append_hex(out, f.info.info_hash);
+				append(out, ',');
+				append_address(out, f.info.key.src);
+				append(out, ',');
+				append_int(out, f.info.key.src_port);
+				append(out, ',');
+				append_address(out, f.info.key.dst);
+				append(out, ',');
+				append_int(out, f.info.key.dst_port);
+				append(out, d == 0 ? ",in" : ",out");
+				append_stats(out, f.stats[d]);
+			}
+		}
+		m_writer.write(m_flows_csv, async_writer::append, out);
+
+		append(out, "info_hash,flows,dir");
+		append_header(out);
+		for (auto i = m_flows.begin(); i != m_flows.end();) {
+			auto const end = std::find_if(i, m_flows.end(), [&](flow const& f)
+				{ return f.info.info_hash != i->info.info_hash; });
+			for (int d = 0; d < 2; ++d) {
+				request_stats s;
+				for (auto j = i; j != end; ++j) s.merge(j->stats[d]);
+				if (s.requests == 0 && s.unrequested == 0) continue;
+				append_hex(out, i->info.info_hash);
+				append(out, ',');
+				append_int(out, end - i);
+				append(out, d == 0 ? ",in" : ",out");
+				append_stats(out, s);
+			}
+			i = end;
+		}
+		m_writer.write(m_torrents_csv, async_writer::append, out);
+	}
+
+private:
+
+	static void append_header(text_buffer& out)
+	{
+		append(out, ",requests,served,cancelled,rejected,choked,unrequested,outstanding"
+			",p50_us,p90_us,p99_us,p999_us,max_us,histogram\n");
+	}
+
+	// the histogram is logged as "<lower bound>:<count>" for each bucket with
+	// samples in it, separated by spaces
+	static void append_stats(text_buffer& out, request_stats const& s)
+	{
+		for (auto const n : {s.requests, s.served, s.cancelled, s.rejected, s.choked
+			, s.unrequested, s.outstanding}) {
+			append(out, ',');
+			append_int(out, n);
+		}
+		for (double const q : {0.5, 0.9, 0.99, 0.999}) {
+			append(out, ',');
+			append_int(out, s.latency.quantile(q));
+		}
+		append(out, ',');
+		append_int(out, s.latency.max());
+		append(out, ',');
+		auto const& buckets = s.latency.buckets();
+		bool first = true;
+		for (std::size_t i = 0; i < buckets.size(); ++i) {
+			if (buckets[i] == 0) continue;
+			if (!first) append(out, ' ');
+			first = false;
+			append_int(out, latency_histogram::lower_bound(int(i)));
+			append(out, ':');
+			append_int(out, buckets[i]);
+		}
+		append(out, '\n');
+	}
+
+	struct flow
+	{
+		flow_info info;
+		std::array<request_stats, 2> stats;
+	};
+
+	async_writer& m_writer;
+	std::uint32_t const m_flows_csv;
+	std::uint32_t const m_torrents_csv;
+
+	// protects everything below
+	std::mutex m_mutex;
+	std::vector<flow> m_flows;
+	bool m_closed = false;
+};
@@ -0,0 +1,223 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "array.hpp"
+#include "bt_event.hpp"
+#include "flow_table.hpp"
+#include "request_latency.hpp"
+#include "queue_profile.hpp"
+
+inline std::uint32_t hash_block(std::uint64_t const& k)
+{
+	return std::uint32_t((k * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+// follows the requests of a connection. The outstanding requests of each
+// direction are kept in a table keyed by (piece, start), holding when the block
+// was requested and its size. PIECE messages are matched to the REQUEST they
+// answer, to time how long the peer took, and every change to the queues is
+// sampled into the pipeline profile. Everything is handed to the logs as the
+// tracker is destroyed
+struct request_tracker
+{
+	// either log may be null
+	request_tracker(flow_info const& f, latency_log* latency, queue_log* queue)
+		: m_flow(f)
+		, m_latency(latency)
+	{
+		if (queue) m_profile = std::make_unique<queue_profile>(*queue, f);
+	}
+
+	request_tracker(request_tracker const&) = delete;
+	request_tracker& operator=(request_tracker const&) = delete;
+
+	~request_tracker()
+	{
+		if (m_latency) m_latency->add(m_flow, {{stats(dir_t::in), stats(dir_t::out)}});
+		if (m_profile) m_profile->close(m_end);
+	}
+
+	// a peer may keep requesting blocks it's never sent. Beyond this many,
+	// requests are counted but not timed
+	static constexpr std::size_t max_outstanding = 0x10000;
+
+	// a REQUEST was sent in direction "d"
+	void request(dir_t const d, std::uint32_t const piece, std::uint32_t const start
+		, std::uint32_t const length, std::int64_t const ts)
+	{
+		auto& t = m_outstanding[d];
+		++m_stats[d].requests;
+		// a block requested twice is timed from the first request
+		std::uint64_t const k = key(piece, start);
+		if (t.size() >= max_outstanding || t.find(k) != nullptr) return;
+		t.emplace(k, outstanding_request{ts, length});
+		m_bytes[d] += length;
+		sample(ts, d);
+	}
+
+	// a PIECE was sent in direction "d", answering a request sent the other
+	// way
+	void piece(dir_t const d, std::uint32_t const piece, std::uint32_t const start
+		, std::int64_t const ts)
+	{
+		dir_t const r = opposite(d);
+		auto& s = m_stats[r];
+		auto const req = retire(r, piece, start);
+		if (!req) {
+			++s.unrequested;
+			return;
+		}
+		++s.served;
+		s.latency.add(ts - req->ts);
+		sample(ts, r);
+	}
+
+	// a CANCEL was sent in direction "d"
+	void cancel(dir_t const d, std::uint32_t const piece, std::uint32_t const start
+		, std::int64_t const ts)
+	{
+		if (!retire(d, piece, start)) return;
+		++m_stats[d].cancelled;
+		sample(ts, d);
+	}
+
+	// a REJECT was sent in direction "d", for a request sent the other way
+	void reject(dir_t const d, std::uint32_t const piece, std::uint32_t const start
+		, std::int64_t const ts)
+	{
+		dir_t const r = opposite(d);
+		if (!retire(r, piece, start)) return;
+		++m_stats[r].rejected;
+		sample(ts, r);
+	}
+
+	// a CHOKE was sent in direction "d". Unless both ends support the fast
+	// extension ("discard" is false), the requests sent the other way are
+	// discarded
+	void choke(dir_t const d, bool const discard, std::int64_t const ts)
+	{
+		dir_t const r = opposite(d);
+		m_unchoked[r] = false;
+		if (discard) {
+			m_stats[r].choked += m_outstanding[r].size();
+			m_outstanding[r].clear();
+			m_bytes[r] = 0;
+		}
+		sample(ts, r);
+	}
+
+	// an UNCHOKE was sent in direction "d"
+	void unchoke(dir_t const d, std::int64_t const ts)
+	{
+		dir_t const r = opposite(d);
+		m_unchoked[r] = true;
+		sample(ts, r);
+	}
+
+	// an INTERESTED or NOT-INTERESTED was sent in direction "d"
+	void interested(dir_t const d, bool const interested, std::int64_t const ts)
+	{
+		m_interested[d] = interested;
+		sample(ts, d);
+	}
+
+	// the connection was active at "ts". Queues still starved as the tracker
+	// is destroyed are starved until the last of these
+	void seen(std::int64_t const ts)
+	{
+		if (ts > m_end) m_end = ts;
+	}
+
+	// the stats of requests sent in direction "d", counting the ones still
+	// waiting as outstanding
+	request_stats stats(dir_t const d) const
+	{
+		request_stats ret = m_stats[d];
+		ret.outstanding = m_outstanding[d].size();
+		return ret;
+	}
+
+private:
+
+	struct outstanding_request
+	{
+		std::int64_t ts;
+		std::uint32_t length;
+	};
+
+	static std::uint64_t key(std::uint32_t const piece, std::uint32_t const start)
+	{
+		return (std::uint64_t(piece) << 32) | start;
+	}
+
+	// removes the request from the queue of direction "d", if it's there
+	std::optional<outstanding_request> retire(dir_t const d, std::uint32_t const piece
+		, std::uint32_t const start)
+	{
+		auto& t = m_outstanding[d];
+		std::uint64_t const k = key(piece, start);
+		auto const* req = t.find(k);
+		if (req == nullptr) return std::nullopt;
+		outstanding_request const ret = *req;
+		m_bytes[d] -= ret.length;
+		t.erase(k);
+		return ret;
+	}
+
+	void sample(std::int64_t const ts, dir_t const d)
+	{
+		if (!m_profile) return;
+		m_profile->sample(ts, d, queue_depth{std::uint32_t(m_outstanding[d].size()), m_bytes[d]}
+			, m_unchoked[d] && m_interested[d]);
+	}
+
+	flow_info m_flow;
+	latency_log* m_latency;
+	std::unique_ptr<queue_profile> m_profile;
+	// the last time the connection was seen
+	std::int64_t m_end = 0;
+
+	array<request_stats, 2, dir_t> m_stats;
+	array<open_hash_table<std::uint64_t, outstanding_request, &hash_block>, 2, dir_t> m_outstanding;
+	array<std::uint64_t, 2, dir_t> m_bytes{};
+	// whether the requests of each direction would be served: the peer has
+	// unchoked us, and we're interested
+	array<bool, 2, dir_t> m_unchoked{};
+	array<bool, 2, dir_t> m_interested{};
+};
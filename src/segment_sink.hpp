@@ -0,0 +1,157 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "bt_event.hpp"
+#include "event_sink.hpp"
+#include "binary_log.hpp"
+#include "async_writer.hpp"
+#include "str.hpp"
+
+// logs the events of all streams of a torrent to a single segment file,
+// bt/<info-hash>.seg, in the binary log format (see binary_log.hpp). Records
+// are collected in a large block per segment before being handed to the
+// writer, which only keeps a bounded number of files open at any time, no
+// matter how many streams are being logged. Streams may be logged from any
+// number of threads
+struct segment_sink final : event_sink
+{
+	struct flow_handle
+	{
+		std::uint32_t segment;
+		std::uint32_t flow;
+	};
+
+	explicit segment_sink(async_writer& w) : m_writer(w) {}
+
+	segment_sink(segment_sink const&) = delete;
+	segment_sink& operator=(segment_sink const&) = delete;
+
+	~segment_sink() { close(); }
+
+	std::unique_ptr<flow_log> open_flow(flow_info const& f) override
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto it = m_segment_index.find(f.info_hash);
+		if (it == m_segment_index.end()) {
+			mkdir("bt", 0755);
+			auto s = std::make_unique<segment>();
+			s->path = str("bt/", info_hash_str(f.info_hash), ".seg");
+			s->file = m_writer.add_file(s->path);
+			binary_log_header const hdr = make_binary_log_header();
+			auto const* ptr = reinterpret_cast<char const*>(&hdr);
+			s->block.reserve(block_size);
+			s->block.assign(ptr, ptr + sizeof(hdr));
+			it = m_segment_index.emplace(f.info_hash, std::uint32_t(m_segments.size())).first;
+			m_segments.push_back(std::move(s));
+		}
+		flow_handle const h{it->second, m_segments[it->second]->index.add_flow(f)};
+		return std::make_unique<buffered_flow_log<segment_sink>>(*this, h);
+	}
+
+	// hands the remaining records and the index of every segment to the
+	// writer. All flow logs must have been destroyed by now. The segments are
+	// complete once the writer is closed
+	void close()
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		for (auto& s : m_segments) {
+			if (s->closed) continue;
+			s->closed = true;
+			auto const footer = s->index.footer();
+			s->block.insert(s->block.end(), footer.begin(), footer.end());
+			write_block(*s);
+		}
+	}
+
+	// the segment files written so far
+	std::vector<std::string> segments() const
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		std::vector<std::string> ret;
+		for (auto const& s : m_segments) ret.push_back(s->path);
+		return ret;
+	}
+
+	void append(flow_handle const h, std::vector<event_record> const& records)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto& s = *m_segments[h.segment];
+		s.index.add_extent(h.flow, records.size());
+		auto const* ptr = reinterpret_cast<char const*>(records.data());
+		s.block.insert(s.block.end(), ptr, ptr + records.size() * sizeof(event_record));
+		if (s.block.size() >= block_size) write_block(s);
+	}
+
+private:
+
+	// the records of a segment are written in blocks of (at least) this size
+	static constexpr std::size_t block_size = 128 * 1024;
+
+	struct segment
+	{
+		std::string path;
+		std::uint32_t file;
+		binary_log_index index;
+		// the bytes not yet written, starting at file offset "written"
+		std::vector<char> block;
+		std::uint64_t written = 0;
+		bool closed = false;
+	};
+
+	// the block is swapped with a buffer the writer is done with
+	void write_block(segment& s)
+	{
+		if (s.block.empty()) return;
+		std::uint64_t const offset = s.written;
+		s.written += s.block.size();
+		m_writer.write(s.file, offset, s.block);
+		s.block.reserve(block_size);
+	}
+
+	async_writer& m_writer;
+
+	// protects everything below
+	mutable std::mutex m_mutex;
+	std::map<std::array<unsigned char, 20>, std::uint32_t> m_segment_index;
+	std::vector<std::unique_ptr<segment>> m_segments;
+};
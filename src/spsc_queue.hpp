@@ -0,0 +1,121 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+// a bounded, lock-free, single-producer single-consumer ring buffer. Slots are
+// filled and consumed in-place, so a slot's members (like buffers) are reused
+// across laps around the ring rather than reallocated.
+//
+// the producer calls back() to get the next free slot, fills it in and then
+// publishes it with push(). The consumer calls front() to get the oldest
+// published slot and hands it back with pop() once it's done with it.
+template <typename T>
+struct spsc_queue
+{
+	// capacity must be a power of two
+	explicit spsc_queue(std::size_t const capacity)
+		: m_slots(new T[capacity])
+		, m_mask(capacity - 1)
+	{
+		assert(capacity > 0 && (capacity & m_mask) == 0);
+	}
+
+	spsc_queue(spsc_queue const&) = delete;
+	spsc_queue& operator=(spsc_queue const&) = delete;
+
+	// producer side. Returns nullptr if the queue is full
+	T* back()
+	{
+		std::size_t const head = m_head.load(std::memory_order_relaxed);
+		if (head - m_cached_tail > m_mask) {
+			m_cached_tail = m_tail.load(std::memory_order_acquire);
+			if (head - m_cached_tail > m_mask) return nullptr;
+		}
+		return &m_slots[head & m_mask];
+	}
+
+	void push()
+	{
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// consumer side. Returns nullptr if the queue is empty
+	T* front()
+	{
+		std::size_t const tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_cached_head) {
+			m_cached_head = m_head.load(std::memory_order_acquire);
+			if (tail == m_cached_head) return nullptr;
+		}
+		return &m_slots[tail & m_mask];
+	}
+
+	// consumer side. Returns the i:th oldest published slot, or nullptr if
+	// there aren't that many. front() is peek(0)
+	T* peek(std::size_t const i)
+	{
+		std::size_t const tail = m_tail.load(std::memory_order_relaxed);
+		if (m_cached_head - tail <= i) {
+			m_cached_head = m_head.load(std::memory_order_acquire);
+			if (m_cached_head - tail <= i) return nullptr;
+		}
+		return &m_slots[(tail + i) & m_mask];
+	}
+
+	void pop()
+	{
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	std::size_t size() const
+	{
+		return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+	}
+
+private:
+	std::unique_ptr<T[]> m_slots;
+	std::size_t const m_mask;
+
+	// the producer and consumer indices live on separate cache lines, along
+	// with each side's cached copy of the other's index, to avoid false sharing
+	alignas(64) std::atomic<std::size_t> m_head{0};
+	std::size_t m_cached_tail = 0;
+
+	alignas(64) std::atomic<std::size_t> m_tail{0};
+	std::size_t m_cached_head = 0;
+};
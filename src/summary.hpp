@@ -0,0 +1,384 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bt_event.hpp"
+#include "event_sink.hpp"
+#include "async_writer.hpp"
+#include "format.hpp"
+
+// The binary summary is a single file made up of:
+//
+//   summary_header
+//   flow_summary[]       (sorted by info-hash, then flow ID)
+//   torrent_summary[]    (sorted by info-hash)
+//
+// All integers are in host byte order. Counters and handshake fields are kept
+// per direction, indexed by dir_t.
+
+constexpr char summary_magic[8] = {'T', 'B', 'T', 'S', 'U', 'M', '0', '1'};
+constexpr std::uint32_t summary_version = 1;
+
+// the messages of a stream are counted in these slots. Slots below 21 count
+// messages by ID (EXTENSION includes the extension handshake). IDs without a
+// name are counted as unknown, so their slots are always 0
+enum summary_counter
+{
+	extension_counter = 20,
+	keep_alive_counter,
+	unknown_counter,
+	// messages whose size doesn't match their type, or are too large
+	invalid_counter,
+	num_summary_counters
+};
+
+struct summary_header
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t flow_size;
+	std::uint32_t torrent_size;
+	std::uint32_t pad;
+	std::uint64_t num_flows;
+	std::uint64_t num_torrents;
+};
+
+struct flow_summary
+{
+	std::uint64_t flow_id;
+	// microseconds since the epoch, of the first and last event
+	std::int64_t first;
+	std::int64_t last;
+	std::uint32_t src;
+	std::uint32_t dst;
+	std::uint16_t src_port;
+	std::uint16_t dst_port;
+	std::array<unsigned char, 20> info_hash;
+	// the PIECE bytes received
+	std::array<std::uint64_t, 2> payload;
+	// all zeros if the handshake wasn't seen
+	std::array<std::array<unsigned char, 8>, 2> reserved;
+	std::array<std::array<unsigned char, 20>, 2> peer_id;
+	std::array<std::array<std::uint32_t, num_summary_counters>, 2> messages;
+};
+
+struct torrent_summary
+{
+	std::array<unsigned char, 20> info_hash;
+	std::uint32_t num_flows;
+	std::int64_t first;
+	std::int64_t last;
+	std::array<std::uint64_t, 2> payload;
+	std::array<std::array<std::uint64_t, num_summary_counters>, 2> messages;
+};
+
+static_assert(sizeof(summary_header) == 40, "summary_header is expected to be 40 bytes");
+static_assert(sizeof(flow_summary) == 320, "flow_summary is expected to be 320 bytes");
+static_assert(sizeof(torrent_summary) == 440, "torrent_summary is expected to be 440 bytes");
+
+// the column names of the counters in the CSV tables. Slots that are always 0
+// are left out
+inline char const* summary_counter_name(int const i)
+{
+	static constexpr std::array<char const*, num_summary_counters> names = {{"choke", "unchoke"
+		, "interested", "not_interested", "have", "bitfield", "request", "piece", "cancel"
+		, "dht_port", nullptr, nullptr, nullptr, "suggest", "have_all", "have_none", "reject"
+		, "allowed_fast", nullptr, nullptr, "extension", "keep_alive", "unknown", "invalid"}};
+	return names[std::size_t(i)];
+}
+
+// instead of logging the events of streams, counts them. Nothing is written
+// until close(), which writes the summary of every stream and torrent to
+// "<prefix>.bin" (in the format above) and as CSV to "<prefix>.csv" and
+// "<prefix>-torrents.csv". Streams may be summarized from any number of
+// threads
+struct summary_sink final : event_sink
+{
+	summary_sink(std::string const& prefix, async_writer& w)
+		: m_writer(w)
+		, m_binary(w.add_file(prefix + ".bin", true))
+		, m_flows_csv(w.add_file(prefix + ".csv"))
+		, m_torrents_csv(w.add_file(prefix + "-torrents.csv"))
+	{}
+
+	summary_sink(summary_sink const&) = delete;
+	summary_sink& operator=(summary_sink const&) = delete;
+
+	~summary_sink() { close(); }
+
+	std::unique_ptr<flow_log> open_flow(flow_info const& f) override
+	{
+		return std::make_unique<summary_log>(*this, f);
+	}
+
+	// hands the tables to the writer. All flow logs must have been destroyed
+	// by now. The files are complete once the writer is closed
+	void close()
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		if (m_closed) return;
+		m_closed = true;
+
+		std::sort(m_flows.begin(), m_flows.end(), [](flow_summary const& lhs, flow_summary const& rhs)
+		{
+			if (lhs.info_hash != rhs.info_hash) return lhs.info_hash < rhs.info_hash;
+			return lhs.flow_id < rhs.flow_id;
+		});
+
+		std::vector<torrent_summary> torrents;
+		for (auto const& f : m_flows) {
+			if (torrents.empty() || torrents.back().info_hash != f.info_hash) {
+				torrents.emplace_back();
+				torrents.back().info_hash = f.info_hash;
+				torrents.back().first = f.first;
+				torrents.back().last = f.last;
+			}
+			auto& t = torrents.back();
+			++t.num_flows;
+			t.first = std::min(t.first, f.first);
+			t.last = std::max(t.last, f.last);
+			for (int d = 0; d < 2; ++d) {
+				t.payload[d] += f.payload[d];
+				for (int i = 0; i < num_summary_counters; ++i)
+					t.messages[d][i] += f.messages[d][i];
+			}
+		}
+
+		summary_header hdr{};
+		std::memcpy(hdr.magic, summary_magic, sizeof(hdr.magic));
+		hdr.version = summary_version;
+		hdr.flow_size = sizeof(flow_summary);
+		hdr.torrent_size = sizeof(torrent_summary);
+		hdr.num_flows = m_flows.size();
+		hdr.num_torrents = torrents.size();
+
+		std::vector<char> buf;
+		append_bytes(buf, &hdr, sizeof(hdr));
+		append_bytes(buf, m_flows.data(), m_flows.size() * sizeof(flow_summary));
+		append_bytes(buf, torrents.data(), torrents.size() * sizeof(torrent_summary));
+		m_writer.write(m_binary, 0, buf);
+
+		text_buffer out;
+		append(out, "flow,info_hash,src,src_port,dst,dst_port,first,last");
+		append_header(out, {"peer_id", "reserved", "payload"});
+		append_counter_header(out);
+		append(out, '\n');
+		for (auto const& f : m_flows) {
+			append_int(out, f.flow_id);
+			append(out, ',');
+			append_hex(out, f.info_hash);
+			append(out, ',');
+			append_address(out, address_v4(f.src));
+			append(out, ',');
+			append_int(out, f.src_port);
+			append(out, ',');
+			append_address(out, address_v4(f.dst));
+			append(out, ',');
+			append_int(out, f.dst_port);
+			append_times(out, f.first, f.last);
+			for (auto const& id : f.peer_id) { append(out, ','); append_hex(out, id); }
+			for (auto const& r : f.reserved) { append(out, ','); append_hex(out, r); }
+			append_counters(out, f.payload, f.messages);
+			append(out, '\n');
+		}
+		m_writer.write(m_flows_csv, async_writer::append, out);
+
+		append(out, "info_hash,flows,first,last");
+		append_header(out, {"payload"});
+		append_counter_header(out);
+		append(out, '\n');
+		for (auto const& t : torrents) {
+			append_hex(out, t.info_hash);
+			append(out, ',');
+			append_int(out, t.num_flows);
+			append_times(out, t.first, t.last);
+			append_counters(out, t.payload, t.messages);
+			append(out, '\n');
+		}
+		m_writer.write(m_torrents_csv, async_writer::append, out);
+	}
+
+private:
+
+	struct summary_log final : flow_log
+	{
+		summary_log(summary_sink& s, flow_info const& f)
+			: m_sink(s)
+		{
+			m_summary.flow_id = f.flow_id;
+			m_summary.src = std::uint32_t(f.key.src.to_ulong());
+			m_summary.dst = std::uint32_t(f.key.dst.to_ulong());
+			m_summary.src_port = f.key.src_port;
+			m_summary.dst_port = f.key.dst_port;
+			m_summary.info_hash = f.info_hash;
+		}
+
+		summary_log(summary_log const&) = delete;
+		summary_log& operator=(summary_log const&) = delete;
+
+		void write(event_record const& e, span<unsigned char const> blob) override
+		{
+			auto& s = m_summary;
+			int const d = int(e.dir);
+
+			// the reorder depth is logged without a timestamp, as the stream is
+			// torn down
+			if (e.timestamp != 0) {
+				if (s.first == 0) s.first = e.timestamp;
+				s.last = e.timestamp;
+			}
+
+			if (std::uint8_t(e.type) < 64) {
+				if (std::uint8_t(e.type) < num_summary_counters) ++s.messages[d][std::uint8_t(e.type)];
+				m_in_piece[d] = (e.type == event_type(7));
+				return;
+			}
+
+			switch (e.type) {
+				case event_type::reserved: copy(s.reserved[d], blob); break;
+				case event_type::peer_id: copy(s.peer_id[d], blob); break;
+				case event_type::keep_alive: ++s.messages[d][keep_alive_counter]; break;
+				// the body of an invalid message is skipped as payload records,
+				// which mustn't count toward the PIECE before it
+				case event_type::message_too_large:
+				case event_type::invalid_size:
+					++s.messages[d][invalid_counter];
+					m_in_piece[d] = false;
+					break;
+				case event_type::unknown_message:
+					++s.messages[d][unknown_counter];
+					m_in_piece[d] = false;
+					break;
+				case event_type::extension_handshake:
+				case event_type::extension_message:
+					++s.messages[d][extension_counter];
+					m_in_piece[d] = false;
+					break;
+				case event_type::payload:
+					if (m_in_piece[d]) s.payload[d] += e.length;
+					break;
+				default: break;
+			}
+		}
+
+		~summary_log()
+		{
+			std::lock_guard<std::mutex> l(m_sink.m_mutex);
+			m_sink.m_flows.push_back(m_summary);
+		}
+
+	private:
+
+		template <std::size_t N>
+		static void copy(std::array<unsigned char, N>& out, span<unsigned char const> blob)
+		{
+			std::memcpy(out.data(), blob.data(), std::min(N, std::size_t(blob.size())));
+		}
+
+		summary_sink& m_sink;
+		flow_summary m_summary{};
+		// whether the payload being skipped in each direction belongs to a
+		// PIECE message
+		std::array<bool, 2> m_in_piece{};
+	};
+
+	static void append_bytes(std::vector<char>& buf, void const* data, std::size_t const size)
+	{
+		auto const* ptr = static_cast<char const*>(data);
+		buf.insert(buf.end(), ptr, ptr + size);
+	}
+
+	// "<name>_in,<name>_out" for each of "names"
+	static void append_header(text_buffer& out, std::initializer_list<char const*> const names)
+	{
+		for (auto const n : names) {
+			append(out, ',');
+			append(out, n);
+			append(out, "_in,");
+			append(out, n);
+			append(out, "_out");
+		}
+	}
+
+	static void append_counter_header(text_buffer& out)
+	{
+		for (int i = 0; i < num_summary_counters; ++i) {
+			if (summary_counter_name(i) == nullptr) continue;
+			append_header(out, {summary_counter_name(i)});
+		}
+	}
+
+	static void append_times(text_buffer& out, std::int64_t const first, std::int64_t const last)
+	{
+		append(out, ',');
+		append_timestamp(out, to_timeval(first));
+		append(out, ',');
+		append_timestamp(out, to_timeval(last));
+	}
+
+	template <typename Int>
+	static void append_counters(text_buffer& out, std::array<std::uint64_t, 2> const& payload
+		, std::array<std::array<Int, num_summary_counters>, 2> const& messages)
+	{
+		for (auto const p : payload) {
+			append(out, ',');
+			append_int(out, p);
+		}
+		for (int i = 0; i < num_summary_counters; ++i) {
+			if (summary_counter_name(i) == nullptr) continue;
+			for (auto const& m : messages) {
+				append(out, ',');
+				append_int(out, m[std::size_t(i)]);
+			}
+		}
+	}
+
+	async_writer& m_writer;
+	std::uint32_t const m_binary;
+	std::uint32_t const m_flows_csv;
+	std::uint32_t const m_torrents_csv;
+
+	// protects everything below
+	std::mutex m_mutex;
+	std::vector<flow_summary> m_flows;
+	bool m_closed = false;
+};
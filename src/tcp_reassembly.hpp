@@ -0,0 +1,213 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "span.hpp"
+#include "payload_arena.hpp"
+
+using libtorrent::span;
+
+// buffers the out-of-order part of one direction of a TCP stream. Bytes are
+// stored in a ring buffer, at the position of their sequence number, and the
+// ranges we have are kept in a sorted interval set. Segments overlapping data
+// already received (e.g. re-packetized retransmits) are trimmed to the part
+// that's new. Once the gap in front of the buffered data is filled, it's
+// delivered as (at most two) large spans straight out of the ring.
+//
+// Offsets are relative to the next byte the stream expects to deliver. The
+// ring is only allocated while there's something buffered, it grows as needed
+// up to "max_window" bytes ahead of the stream. It's allocated from the payload
+// arena.
+struct tcp_reassembly
+{
+	static constexpr std::uint32_t max_window = 32 * 1024 * 1024;
+
+	// buffers "buf", which starts "offset" bytes into the future. Returns false
+	// if it's too far ahead to be buffered
+	bool insert(std::uint32_t const offset, span<unsigned char const> buf)
+	{
+		std::uint64_t const end64 = std::uint64_t(offset) + std::uint64_t(buf.size());
+		if (end64 > max_window) return false;
+		std::uint32_t const end = std::uint32_t(end64);
+		if (end > m_size) grow(end);
+
+		// only copy the ranges we don't have yet
+		std::uint32_t cursor = offset;
+		for (auto const& iv : m_intervals) {
+			if (iv.end <= cursor) continue;
+			if (iv.begin >= end) break;
+			if (iv.begin > cursor) write(cursor, buf.subspan(cursor - offset, iv.begin - cursor));
+			cursor = std::max(cursor, iv.end);
+			if (cursor >= end) break;
+		}
+		if (cursor < end) write(cursor, buf.subspan(cursor - offset, end - cursor));
+
+		add_interval(offset, end);
+		return true;
+	}
+
+	// the stream has moved forward by "n" bytes (delivered by the caller). Any
+	// buffered data that's now contiguous with the stream is passed to
+	// f(span<unsigned char const>). Returns the number of bytes delivered this
+	// way.
+	template <typename Fun>
+	std::uint32_t advance(std::uint32_t const n, Fun&& f)
+	{
+		if (m_intervals.empty()) return 0;
+		shift(n);
+
+		std::uint32_t delivered = 0;
+		if (!m_intervals.empty() && m_intervals.front().begin == 0) {
+			std::uint32_t const len = m_intervals.front().end;
+			std::uint32_t const pos = m_pos & m_mask;
+			std::uint32_t const first = std::min(len, m_size - pos);
+			f(span<unsigned char const>(m_ring.data() + pos, first));
+			if (first < len) f(span<unsigned char const>(m_ring.data(), len - first));
+			shift(len);
+			delivered = len;
+		}
+
+		// don't hang on to the memory while there's no gap in the stream
+		if (m_intervals.empty()) clear();
+		return delivered;
+	}
+
+	// the number of bytes buffered
+	std::uint32_t size() const
+	{
+		std::uint32_t ret = 0;
+		for (auto const& iv : m_intervals) ret += iv.end - iv.begin;
+		return ret;
+	}
+
+	bool empty() const { return m_intervals.empty(); }
+
+	void clear()
+	{
+		m_intervals.clear();
+		m_ring.reset();
+		m_size = 0;
+		m_mask = 0;
+	}
+
+private:
+
+	// [begin, end), relative to m_pos
+	struct interval
+	{
+		std::uint32_t begin;
+		std::uint32_t end;
+	};
+
+	// moves the start of the stream forward by "n" bytes, dropping anything
+	// before it
+	void shift(std::uint32_t const n)
+	{
+		m_pos += n;
+		auto out = m_intervals.begin();
+		for (auto const& iv : m_intervals) {
+			if (iv.end <= n) continue;
+			*out++ = interval{std::max(iv.begin, n) - n, iv.end - n};
+		}
+		m_intervals.erase(out, m_intervals.end());
+	}
+
+	void add_interval(std::uint32_t begin, std::uint32_t end)
+	{
+		// find the range of intervals overlapping or adjacent to the new one
+		auto first = std::lower_bound(m_intervals.begin(), m_intervals.end(), begin
+			, [](interval const& iv, std::uint32_t const b) { return iv.end < b; });
+		auto last = first;
+		while (last != m_intervals.end() && last->begin <= end) {
+			begin = std::min(begin, last->begin);
+			end = std::max(end, last->end);
+			++last;
+		}
+		if (first == last) {
+			m_intervals.insert(first, interval{begin, end});
+			return;
+		}
+		*first = interval{begin, end};
+		m_intervals.erase(first + 1, last);
+	}
+
+	void write(std::uint32_t const offset, span<unsigned char const> buf)
+	{
+		std::uint32_t const pos = (m_pos + offset) & m_mask;
+		std::uint32_t const len = std::uint32_t(buf.size());
+		std::uint32_t const first = std::min(len, m_size - pos);
+		std::memcpy(m_ring.data() + pos, buf.data(), first);
+		std::memcpy(m_ring.data(), buf.data() + first, len - first);
+	}
+
+	// the ring must be at least "size" bytes, to not wrap around within the
+	// window we're buffering
+	void grow(std::uint32_t const size)
+	{
+		std::uint32_t new_size = std::max(m_size, std::uint32_t(0x10000));
+		while (new_size < size) new_size *= 2;
+
+		ring_buffer ring(new_size);
+		std::uint32_t const new_mask = new_size - 1;
+		for (auto const& iv : m_intervals) {
+			for (std::uint32_t i = iv.begin; i < iv.end;) {
+				std::uint32_t const from = (m_pos + i) & m_mask;
+				std::uint32_t const to = (m_pos + i) & new_mask;
+				std::uint32_t const len = std::min({iv.end - i, m_size - from, new_size - to});
+				std::memcpy(ring.data() + to, m_ring.data() + from, len);
+				i += len;
+			}
+		}
+		m_ring = std::move(ring);
+		m_size = new_size;
+		m_mask = new_mask;
+	}
+
+	// the sequence number of the next byte the stream expects. It's only used
+	// to determine the position in the ring, which is why it doesn't need to
+	// line up with the actual sequence numbers
+	std::uint32_t m_pos = 0;
+
+	using ring_buffer = arena_buffer<arena_tag::tcp_reassembly>;
+	ring_buffer m_ring;
+	std::uint32_t m_size = 0;
+	std::uint32_t m_mask = 0;
+
+	// sorted, non-overlapping and non-adjacent
+	std::vector<interval, arena_allocator<interval, arena_tag::tcp_reassembly>> m_intervals;
+};
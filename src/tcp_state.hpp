@@ -37,12 +37,18 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "stream_key.hpp"
 #include "span.hpp"
 #include "array.hpp"
+#include "tcp_reassembly.hpp"
 
 using libtorrent::span;
 using boost::asio::ip::address_v4;
 
 enum class dir_t : std::uint8_t { in, out };
 
+inline dir_t opposite(dir_t const d)
+{
+	return d == dir_t::in ? dir_t::out : dir_t::in;
+}
+
 inline std::ostream& operator<<(std::ostream& os, dir_t const d)
 {
 	switch (d) {
@@ -54,93 +60,145 @@ inline std::ostream& operator<<(std::ostream& os, dir_t const d)
 
 enum socket_event_t : std::uint8_t
 {
-	reset, fin, seqnr_mismatch
+	reset, fin, seqnr_mismatch, timeout
 };
 
-inline std::ostream& operator<<(std::ostream& os, socket_event_t const e)
+inline char const* socket_event_name(socket_event_t const e)
 {
 	using se = socket_event_t;
 	switch (e) {
-		case se::reset: return os << "RESET";
-		case se::fin: return os << "FIN";
-		case se::seqnr_mismatch: return os << "(transport layer: mismatching sequence numbers)";
+		case se::reset: return "RESET";
+		case se::fin: return "FIN";
+		case se::seqnr_mismatch: return "(transport layer: mismatching sequence numbers)";
+		case se::timeout: return "(transport layer: idle timeout)";
 	};
-	return os << "EVENT: ??";
+	return "EVENT: ??";
+}
+
+inline std::ostream& operator<<(std::ostream& os, socket_event_t const e)
+{
+	return os << socket_event_name(e);
 }
 
 
+// what a handler wants done with a flow, returned from its data() function
+enum class verdict : std::uint8_t
+{
+	// keep delivering data
+	keep,
+	// no more data in this direction. The transport stops reassembling it,
+	// but the flow is still tracked and its events (FIN, RESET, timeout) are
+	// still passed on
+	ignore,
+	// the handler is done with the flow. The transport frees its reassembly
+	// state and nothing more is passed on. The processor only keeps a marker
+	// to discard the flow's packets until it's closed or times out
+	drop
+};
+
 struct tcp_side_state
 {
 	bool closed = false;
+	// the handler doesn't want any more data in this direction
+	bool ignored = false;
 	std::uint32_t seqnr = 0;
 	// store out of order segments here
-	std::map<std::uint32_t, std::vector<unsigned char>> ooo_;
+	tcp_reassembly ooo_;
 };
 
 template <typename Handler>
 struct tcp_state
 {
-	tcp_state(stream_key const& k)
-		: key(k)
-		, handler(k)
+	// any additional arguments are passed on to the handler
+	template <typename... Args>
+	tcp_state(stream_key const& k, std::uint64_t const id, Args&&... args)
+		: flow_id(id)
+		, key(k)
+		, handler(k, id, std::forward<Args>(args)...)
 	{}
 
 	void syn(tcphdr const& hdr, dir_t const d)
 	{
 		state_[d].seqnr = ntohl(hdr.seq) + 1;
+		state_[d].ooo_.clear();
 	}
 
 	bool fin(timeval const& ts, dir_t const d)
 	{
 		state_[d].closed = true;
-		handler.event(ts, socket_event_t::fin, d);
+		if (!dropped_) handler.event(ts, socket_event_t::fin, d);
 		return state_[(d == dir_t::out) ? dir_t::in : dir_t::out].closed;
 	}
 
 	void rst(timeval const& ts, dir_t const d)
 	{
-		handler.event(ts, socket_event_t::reset, d);
+		if (!dropped_) handler.event(ts, socket_event_t::reset, d);
 	}
 
-	// returns false if this packet is a duplicate and should be ignored. For now
-	// re-packetized messages are not supported. i.e. no overlapping byte ranges
+	// the stream has been idle for too long and is about to be dropped
+	void timeout(timeval const& ts)
+	{
+		if (!dropped_) handler.event(ts, socket_event_t::timeout, dir_t::out);
+	}
+
+	// true once the handler has asked for the flow to be dropped. Its packets
+	// should be discarded without calling packet()
+	bool dropped() const { return dropped_; }
+
+	// segments may overlap data we've already seen, only the bytes that are new
+	// are delivered to the handler
 	void packet(timeval const& ts, tcphdr const& hdr, span<unsigned char const> buf, dir_t const d)
 	{
+		assert(!dropped_);
 		if (buf.size() == 0) return;
+		handler.transport(ts, std::size_t(buf.size()), d);
 		auto& s = state_[d];
-		std::uint32_t const incoming_seqnr = ntohl(hdr.seq);
-		if (incoming_seqnr != s.seqnr) {
+		if (s.ignored) return;
+		std::uint32_t const offset = ntohl(hdr.seq) - s.seqnr;
+		if (offset >= 0x80000000) {
+			// this segment starts before the next byte we expect. Unless it
+			// extends past it, it's a retransmit of data we've already delivered
+			std::uint32_t const old = s.seqnr - ntohl(hdr.seq);
+			if (old >= std::uint32_t(buf.size())) return;
+			buf = buf.subspan(old);
+		}
+		else if (offset > 0) {
 			// if hdr.seq is higher than what we expect, it's an out of order
-			// message. Store it in s.ooo_.
-			if (std::uint32_t(incoming_seqnr - s.seqnr) < std::numeric_limits<std::uint32_t>::max() / 2) {
-				s.ooo_.emplace(incoming_seqnr, std::vector<unsigned char>(buf.begin(), buf.end()));
-//				std::cout << "TCP " << key << " out of order " << s.ooo_.size() << '\n';
-				return;
-			}
-			// if it's a clean retransmit of a segment, don't bother logging
-			if (incoming_seqnr + buf.size() != state_[d].seqnr) {
+			// segment. Store it in s.ooo_.
+			if (!s.ooo_.insert(offset, buf)) {
 //				std::cout << "TCP " << key << '\n';
 //				std::cout << "  mismatch seqnr: " << state_[d].seqnr
-//					<< (d == dir_t::in ? " incoming: " : "outgoing: ") << incoming_seqnr
-//					<< " size: " << buf.size()
-//					<< " diff: " << std::int32_t(state_[d].seqnr - incoming_seqnr) << '\n';
+//					<< (d == dir_t::in ? " incoming: " : "outgoing: ") << ntohl(hdr.seq)
+//					<< " size: " << buf.size() << '\n';
 				handler.event(ts, socket_event_t::seqnr_mismatch, d);
 			}
+//			std::cout << "TCP " << key << " out of order " << s.ooo_.size() << '\n';
+			return;
 		}
-		else {
-			s.seqnr += buf.size();
-			handler.data(ts, buf, d);
-			auto it = s.ooo_.find(s.seqnr);
-			while (it != s.ooo_.end()) {
-				s.seqnr += it->second.size();
-//				std::cout << "TCP " << key << " replaying from out of order buffer: " << s.ooo_.size() << "\n";
-				handler.data(ts, it->second, d);
-				s.ooo_.erase(it);
-				it = s.ooo_.find(s.seqnr);
-			}
+
+		s.seqnr += std::uint32_t(buf.size());
+		verdict v = handler.data(ts, buf, d);
+		s.seqnr += s.ooo_.advance(std::uint32_t(buf.size()), [&](span<unsigned char const> b)
+		{
+//			std::cout << "TCP " << key << " replaying from out of order buffer: " << b.size() << "\n";
+			if (v == verdict::keep) v = handler.data(ts, b, d);
+		});
+		if (v == verdict::ignore) {
+			s.ignored = true;
+			s.ooo_.clear();
+		}
+		else if (v == verdict::drop) {
+			dropped_ = true;
+			for (auto& side : state_) side.ooo_.clear();
 		}
 	}
 
+	// the index of the packet that opened this stream
+	std::uint64_t flow_id;
+
+	// the timestamp (in seconds) of the last packet on this stream
+	std::int64_t last_seen = 0;
+
 private:
 
 	stream_key key;
@@ -149,6 +207,8 @@ private:
 	// That's the outgoing direction. The SYN+ACK is then incoming.
 	array<tcp_side_state, 2, dir_t> state_;
 
+	bool dropped_ = false;
+
 	Handler handler;
 };
 
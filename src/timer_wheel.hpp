@@ -0,0 +1,183 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// a hierarchical timer wheel with a resolution of one second. It has 4 levels
+// of 64 slots each, the first level covering the next 64 seconds, the second
+// the next 64^2 seconds and so on. Timers are moved (cascaded) to a lower level
+// as time approaches their expiry. Timers further out than 64^4 seconds (about
+// 190 days) are parked at the highest level and re-examined every time it
+// cascades.
+//
+// Time is whatever the caller says it is, it only ever moves forward. This is
+// meant to be driven by packet timestamps.
+template <typename T>
+struct timer_wheel
+{
+	// "expires" is in seconds. A timer that's already due fires on the next
+	// call to advance()
+	void schedule(std::int64_t const expires, T payload)
+	{
+		insert(entry{expires, std::move(payload)}, m_now + 1);
+		++m_size;
+	}
+
+	// moves time forward to "now", calling f(T&) for every timer that expires
+	// on the way. f may schedule new timers
+	template <typename Fun>
+	void advance(std::int64_t const now, Fun&& f)
+	{
+		if (!m_started) {
+			// the first call sets the clock. Anything scheduled before then was
+			// placed relative to time 0, and needs to be re-inserted
+			m_now = now;
+			m_started = true;
+			m_level_size.fill(0);
+			std::vector<entry> all;
+			for (auto& level : m_buckets) {
+				for (auto& bucket : level) {
+					for (auto& e : bucket) all.push_back(std::move(e));
+					bucket.clear();
+				}
+			}
+			for (auto& e : all) insert(std::move(e), m_now + 1);
+			return;
+		}
+
+		while (m_now < now) {
+			// there's no need to step through time one second at a time if
+			// there's nothing to expire
+			if (m_size == 0) {
+				m_now = now;
+				break;
+			}
+
+			// nor while the lower levels are empty. Nothing can happen until
+			// the next boundary of the lowest level holding timers, where its
+			// next slot cascades. This matters when the capture's clock jumps
+			int lowest = 0;
+			while (m_level_size[std::size_t(lowest)] == 0) ++lowest;
+			if (lowest > 0) {
+				std::int64_t const next = (m_now | ((std::int64_t(1) << (lowest * bits)) - 1)) + 1;
+				m_now = std::min(now, next) - 1;
+			}
+
+			++m_now;
+
+			// cascade timers from higher levels, whose slot we just reached.
+			// Higher levels first, since their timers may land in a lower
+			// level that's also cascading right now
+			for (int level = levels - 1; level > 0; --level) {
+				if ((m_now & ((std::int64_t(1) << (level * bits)) - 1)) != 0) continue;
+				auto& bucket = m_buckets[std::size_t(level)][slot(m_now, level)];
+				if (bucket.empty()) continue;
+				std::vector<entry> cascade;
+				cascade.swap(bucket);
+				m_level_size[std::size_t(level)] -= cascade.size();
+				// timers expiring this very second go straight into the level 0
+				// slot we're about to fire
+				for (auto& e : cascade) insert(std::move(e), m_now);
+			}
+
+			auto& bucket = m_buckets[0][slot(m_now, 0)];
+			if (bucket.empty()) continue;
+			// f may schedule new timers, which is why we can't fire them
+			// straight out of the bucket
+			m_expired.clear();
+			m_expired.swap(bucket);
+			m_size -= m_expired.size();
+			m_level_size[0] -= m_expired.size();
+			for (auto& e : m_expired) f(e.payload);
+		}
+	}
+
+	std::int64_t now() const { return m_now; }
+	std::size_t size() const { return m_size; }
+
+private:
+
+	struct entry
+	{
+		std::int64_t expires;
+		T payload;
+	};
+
+	static constexpr int bits = 6;
+	static constexpr int levels = 4;
+	static constexpr std::size_t slots = std::size_t(1) << bits;
+
+	static std::size_t slot(std::int64_t const t, int const level)
+	{
+		return std::size_t(t >> (level * bits)) & (slots - 1);
+	}
+
+	// "earliest" is the first second the timer may be placed at
+	void insert(entry e, std::int64_t const earliest)
+	{
+		std::int64_t const when = std::max(e.expires, earliest);
+		// the timer goes in the lowest level where it shares all higher digits
+		// with the current time
+		for (int level = 0; level < levels; ++level) {
+			int const shift = (level + 1) * bits;
+			if ((when >> shift) == (m_now >> shift)) {
+				m_buckets[std::size_t(level)][slot(when, level)].push_back(std::move(e));
+				++m_level_size[std::size_t(level)];
+				return;
+			}
+		}
+		// the top level wraps around. As long as the timer is less than one
+		// lap out, its slot will come around (and cascade) in time
+		++m_level_size[levels - 1];
+		if (when - m_now < (std::int64_t(1) << (levels * bits))) {
+			m_buckets[levels - 1][slot(when, levels - 1)].push_back(std::move(e));
+			return;
+		}
+		// too far out. Park it in the last slot of the top level to be
+		// cascaded, it will be re-inserted when we get there
+		m_buckets[levels - 1][(slot(m_now, levels - 1) + slots - 1) & (slots - 1)].push_back(std::move(e));
+	}
+
+	std::array<std::array<std::vector<entry>, slots>, levels> m_buckets;
+	std::vector<entry> m_expired;
+	// the number of timers in each level
+	std::array<std::size_t, levels> m_level_size{};
+	std::int64_t m_now = 0;
+	std::size_t m_size = 0;
+	bool m_started = false;
+};
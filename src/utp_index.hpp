@@ -0,0 +1,216 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+#include "flow_table.hpp"
+#include "tcp_state.hpp" // for dir_t
+
+// the key a uTP packet is looked up by: the endpoint pair, which end of it sent
+// the packet and the connection ID in its header
+struct utp_index_key
+{
+	flow_key ip;
+	std::uint16_t connid;
+	std::uint16_t swapped;
+
+	friend bool operator==(utp_index_key const& lhs, utp_index_key const& rhs)
+	{
+		return std::memcmp(&lhs, &rhs, sizeof(utp_index_key)) == 0;
+	}
+};
+
+static_assert(sizeof(utp_index_key) == 16, "utp_index_key is expected to be packed");
+
+inline std::uint32_t hash_utp_index_key(utp_index_key const& k)
+{
+	std::uint32_t const extra = (std::uint32_t(k.connid) << 1) | k.swapped;
+	return hash_flow_key(k.ip) ^ (extra * 0x9e3779b1u);
+}
+
+// holds the uTP streams and indexes them by every (sender, connection ID)
+// combination a packet belonging to it may carry. This resolves both the
+// stream and the direction of a packet with a single hash lookup.
+//
+// The stream that sent the SYN (with connection ID "base") is the outgoing
+// direction, and sends packets with connection ID base + 1. The other end
+// sends packets with base, but we also accept base + 1 and base + 2 from it, to
+// be tolerant of implementations being off by one.
+//
+// Streams live in a slot array and keep their ID for as long as they exist.
+template <typename State>
+struct utp_index
+{
+	struct lookup_result
+	{
+		// nullptr if no stream matched
+		State* state;
+		std::uint32_t id;
+		dir_t dir;
+	};
+
+	lookup_result find(canonical_key const& k, std::uint16_t const connid)
+	{
+		auto const* r = m_index.find(utp_index_key{k.key, connid, k.swapped});
+		if (r == nullptr) return {nullptr, 0, dir_t::out};
+		return {&m_streams[r->stream]->state, r->stream, r->dir};
+	}
+
+	// "k" and "connid" are taken from the SYN packet opening the stream
+	template <typename... Args>
+	lookup_result emplace(canonical_key const& k, std::uint16_t const connid, Args&&... args)
+	{
+		std::uint32_t id;
+		if (m_free.empty()) {
+			id = std::uint32_t(m_streams.size());
+			m_streams.emplace_back();
+		}
+		else {
+			id = m_free.back();
+			m_free.pop_back();
+		}
+		auto& s = m_streams[id];
+		s.emplace(k.key, k.swapped, connid, std::forward<Args>(args)...);
+
+		for (auto const& a : aliases(*s)) {
+			// in the unlikely event another stream already claims this key,
+			// it keeps it
+			if (m_index.find(a.first) == nullptr) m_index.emplace(a.first, index_value{id, a.second});
+		}
+
+		int* cnt = m_pairs.find(k.key);
+		if (cnt == nullptr) cnt = &m_pairs.emplace(k.key, 0);
+		++*cnt;
+		auto& cached = m_negative_cache[negative_cache_slot(k.key)];
+		if (cached && *cached == k.key) cached.reset();
+
+		return {&s->state, id, dir_t::out};
+	}
+
+	void erase(std::uint32_t const id)
+	{
+		auto& s = m_streams[id];
+		for (auto const& a : aliases(*s)) {
+			auto const* v = m_index.find(a.first);
+			if (v != nullptr && v->stream == id) m_index.erase(a.first);
+		}
+		auto* cnt = m_pairs.find(s->ip);
+		if (--*cnt == 0) m_pairs.erase(s->ip);
+		s.reset();
+		m_free.push_back(id);
+	}
+
+	// returns nullptr if there is no stream with this ID
+	State* get(std::uint32_t const id)
+	{
+		if (id >= m_streams.size() || !m_streams[id]) return nullptr;
+		return &m_streams[id]->state;
+	}
+
+	// The negative cache remembers endpoint pairs that recently sent
+	// uTP-looking packets (typically other UDP traffic that happens to pass
+	// our header sanity checks) that didn't belong to any stream, while no
+	// stream existed on the pair. Non-SYN packets on such pairs can be rejected
+	// right away, without parsing header options or probing the index. Opening
+	// a stream on a pair evicts it from the cache.
+	bool known_non_utp(flow_key const& k) const
+	{
+		auto const& cached = m_negative_cache[negative_cache_slot(k)];
+		return cached && *cached == k;
+	}
+
+	void add_non_utp(flow_key const& k)
+	{
+		if (m_pairs.find(k) != nullptr) return;
+		m_negative_cache[negative_cache_slot(k)] = k;
+	}
+
+	std::size_t size() const { return m_streams.size() - m_free.size(); }
+
+private:
+
+	struct stream_entry
+	{
+		template <typename... Args>
+		stream_entry(flow_key const& k, bool const swapped, std::uint16_t const c, Args&&... args)
+			: ip(k), initiator_swapped(swapped), connid(c), state(std::forward<Args>(args)...)
+		{}
+
+		flow_key ip;
+		bool initiator_swapped;
+		// the connection ID of the SYN
+		std::uint16_t connid;
+		State state;
+	};
+
+	struct index_value
+	{
+		std::uint32_t stream;
+		dir_t dir;
+	};
+
+	static std::array<std::pair<utp_index_key, dir_t>, 4> aliases(stream_entry const& s)
+	{
+		std::uint16_t const out = s.initiator_swapped;
+		std::uint16_t const in = !s.initiator_swapped;
+		return {{
+			{{s.ip, std::uint16_t(s.connid + 1), out}, dir_t::out},
+			{{s.ip, s.connid, in}, dir_t::in},
+			{{s.ip, std::uint16_t(s.connid + 1), in}, dir_t::in},
+			{{s.ip, std::uint16_t(s.connid + 2), in}, dir_t::in},
+		}};
+	}
+
+	static std::size_t negative_cache_slot(flow_key const& k)
+	{
+		return hash_flow_key(k) & (negative_cache_size - 1);
+	}
+
+	static constexpr std::size_t negative_cache_size = 4096;
+
+	std::vector<std::optional<stream_entry>> m_streams;
+	std::vector<std::uint32_t> m_free;
+	open_hash_table<utp_index_key, index_value, &hash_utp_index_key> m_index;
+
+	// the number of streams on each endpoint pair
+	flow_table<int> m_pairs;
+
+	// direct mapped
+	std::vector<std::optional<flow_key>> m_negative_cache
+		= std::vector<std::optional<flow_key>>(negative_cache_size);
+};
@@ -0,0 +1,159 @@
+/*
+
+Copyright (c) 2020, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "span.hpp"
+#include "payload_arena.hpp"
+
+using libtorrent::span;
+
+// holds out-of-order packets for one direction of a uTP stream, in a circular
+// array indexed by sequence number. uTP limits the number of packets in flight,
+// packets further ahead than "window" of the next expected one aren't buffered
+// (and the stream can't be followed past them).
+//
+// Every slot records the sequence number it holds, and anything that has
+// fallen behind the next expected sequence number is evicted when the stream
+// moves past it. The slot array is only allocated while packets are buffered.
+// Both the slots and the payloads are allocated from the payload arena.
+struct utp_reorder_buffer
+{
+	static constexpr std::uint16_t window = 1024;
+
+	utp_reorder_buffer() = default;
+
+	utp_reorder_buffer(utp_reorder_buffer&& rhs) noexcept
+		: m_slots(std::move(rhs.m_slots))
+		, m_count(std::exchange(rhs.m_count, 0))
+		, m_max_depth(std::exchange(rhs.m_max_depth, 0))
+	{}
+
+	utp_reorder_buffer& operator=(utp_reorder_buffer&& rhs) noexcept
+	{
+		if (this == &rhs) return *this;
+		m_slots = std::move(rhs.m_slots);
+		m_count = std::exchange(rhs.m_count, 0);
+		m_max_depth = std::exchange(rhs.m_max_depth, 0);
+		return *this;
+	}
+
+	// "distance" is how far ahead of the next expected packet this one is.
+	// Returns false if it's outside the window
+	bool insert(std::uint16_t const seq_nr, std::uint16_t const distance
+		, span<unsigned char const> buf)
+	{
+		if (distance >= window) return false;
+		if (distance > m_max_depth) m_max_depth = distance;
+		if (m_slots.empty()) m_slots.resize(window);
+
+		slot& s = m_slots[seq_nr & (window - 1)];
+		// a duplicate, we already have this one
+		if (s.used && s.seq_nr == seq_nr) return true;
+		if (!s.used) ++m_count;
+		s.buf = payload(std::size_t(buf.size()));
+		std::memcpy(s.buf.data(), buf.data(), std::size_t(buf.size()));
+		s.seq_nr = seq_nr;
+		s.used = true;
+		return true;
+	}
+
+	// "seq_nr" is the packet that was just delivered. Any buffered packets
+	// following it are passed to f(span<unsigned char const>) in order. Returns
+	// the number of packets delivered this way
+	template <typename Fun>
+	std::uint16_t advance(std::uint16_t seq_nr, Fun&& f)
+	{
+		if (m_count == 0) return 0;
+
+		// evict anything still buffered for the packet we just got, it's stale
+		evict(seq_nr);
+
+		std::uint16_t delivered = 0;
+		for (;;) {
+			++seq_nr;
+			slot& s = m_slots[seq_nr & (window - 1)];
+			if (!s.used || s.seq_nr != seq_nr) break;
+			f(span<unsigned char const>(s.buf.data(), std::ptrdiff_t(s.buf.size())));
+			evict(seq_nr);
+			++delivered;
+		}
+
+		// the next packet we expect may have a stale entry from before the
+		// sequence numbers wrapped
+		evict(seq_nr);
+		if (m_count == 0) clear();
+		return delivered;
+	}
+
+	// the number of packets buffered
+	int size() const { return m_count; }
+
+	// the furthest ahead of the stream any packet has arrived, in packets
+	int max_depth() const { return m_max_depth; }
+
+	void clear()
+	{
+		// this frees the payloads too
+		m_slots = decltype(m_slots)();
+		m_count = 0;
+	}
+
+private:
+
+	using payload = arena_buffer<arena_tag::utp_reorder>;
+
+	struct slot
+	{
+		payload buf;
+		std::uint16_t seq_nr = 0;
+		bool used = false;
+	};
+
+	void evict(std::uint16_t const seq_nr)
+	{
+		slot& s = m_slots[seq_nr & (window - 1)];
+		if (!s.used) return;
+		s.buf.reset();
+		s.used = false;
+		--m_count;
+	}
+
+	std::vector<slot, arena_allocator<slot, arena_tag::utp_reorder>> m_slots;
+	int m_count = 0;
+	int m_max_depth = 0;
+};
@@ -39,6 +39,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "span.hpp"
 #include "array.hpp"
 #include "utphdr.hpp"
+#include "utp_reorder_buffer.hpp"
 
 using libtorrent::span;
 using boost::asio::ip::address_v4;
@@ -47,45 +48,76 @@ struct utp_side_state
 {
 	bool closed = false;
 	bool connected = false;
+	// the handler doesn't want any more data in this direction
+	bool ignored = false;
 	std::uint16_t seqnr = 0;
 	std::uint16_t connid = 0;
-	// store out of order segments here
-	std::map<std::uint16_t, std::vector<unsigned char>> ooo_;
+	// store out of order packets here
+	utp_reorder_buffer ooo_;
 };
 
 template <typename Handler>
 struct utp_state
 {
-	utp_state(utp_stream_key const& k)
-		: key(k)
-		, handler(k.ip)
+	// any additional arguments are passed on to the handler
+	template <typename... Args>
+	utp_state(utp_stream_key const& k, std::uint64_t const id, Args&&... args)
+		: flow_id(id)
+		, key(k)
+		, handler(k.ip, id, std::forward<Args>(args)...)
 	{}
 
+	utp_state(utp_state&&) = default;
+	utp_state& operator=(utp_state&&) = default;
+
+	~utp_state()
+	{
+		// let the handler know how far out of order packets arrived, if they
+		// did at all
+		if (dropped_) return;
+		for (auto const d : {dir_t::out, dir_t::in}) {
+			int const depth = state_[d].ooo_.max_depth();
+			if (depth > 0) handler.reorder_depth(d, depth);
+		}
+	}
+
 	void syn(utphdr const& hdr, dir_t const d)
 	{
 		auto& s = state_[d];
 		s.connected = true;
 		s.seqnr = hdr.seq_nr + 1;
 		s.connid = hdr.connection_id;
+		s.ooo_.clear();
 	}
 
 	bool fin(timeval const& ts, dir_t const d)
 	{
 		auto& s = state_[d];
 		s.closed = true;
-		handler.event(ts, socket_event_t::fin, d);
+		if (!dropped_) handler.event(ts, socket_event_t::fin, d);
 		return state_[(d == dir_t::out) ? dir_t::in : dir_t::out].closed;
 	}
 
 	void rst(timeval const& ts, dir_t const d)
 	{
-		handler.event(ts, socket_event_t::reset, d);
+		if (!dropped_) handler.event(ts, socket_event_t::reset, d);
 	}
 
+	// the stream has been idle for too long and is about to be dropped
+	void timeout(timeval const& ts)
+	{
+		if (!dropped_) handler.event(ts, socket_event_t::timeout, dir_t::out);
+	}
+
+	// true once the handler has asked for the stream to be dropped. Its
+	// packets should be discarded without calling packet()
+	bool dropped() const { return dropped_; }
+
 	// returns false if this packet is a duplicate and should be ignored. For now
 	// re-packetized messages are not supported. i.e. no overlapping byte ranges
 	void packet(timeval const& ts, utphdr const& hdr, span<unsigned char const> buf, dir_t const d)
 	{
+		assert(!dropped_);
 		auto& s = state_[d];
 		if (!s.connected) {
 			s.seqnr = hdr.seq_nr;
@@ -94,12 +126,23 @@ struct utp_state
 		}
 
 		if (buf.size() == 0) return;
+		// counted before the ignored check, the same as for TCP
+		handler.transport(ts, std::size_t(buf.size()), d);
+		if (s.ignored) return;
 
-		if (hdr.seq_nr != s.seqnr) {
+		std::uint16_t const seq_nr = hdr.seq_nr;
+		if (seq_nr != s.seqnr) {
 			// if hdr.seq is higher than what we expect, it's an out of order
-			// message. Store it in s.ooo_.
-			if (std::uint16_t(hdr.seq_nr - s.seqnr) < std::numeric_limits<std::uint16_t>::max() / 2) {
-				s.ooo_.emplace(hdr.seq_nr, std::vector<unsigned char>(buf.begin(), buf.end()));
+			// message. Store it in s.ooo_. If it's past the reorder window, the
+			// gap before it will never be filled (the receiver already has
+			// this packet), so we give up on this direction of the stream
+			std::uint16_t const distance = std::uint16_t(seq_nr - s.seqnr);
+			if (distance < std::numeric_limits<std::uint16_t>::max() / 2) {
+				if (!s.ooo_.insert(seq_nr, distance, buf)) {
+					handler.event(ts, socket_event_t::seqnr_mismatch, d);
+					s.ignored = true;
+					s.ooo_.clear();
+				}
 //				std::cout << "uTP " << key << " out of order " << s.ooo_.size() << '\n';
 				return;
 			}
@@ -110,18 +153,29 @@ struct utp_state
 		}
 		else {
 			++s.seqnr;
-			handler.data(ts, buf, d);
-			auto it = s.ooo_.find(s.seqnr);
-			while (it != s.ooo_.end()) {
-				++s.seqnr;
+			verdict v = handler.data(ts, buf, d);
+			s.seqnr += s.ooo_.advance(seq_nr, [&](span<unsigned char const> b)
+			{
 //				std::cout << "uTP " << key << " replaying from out of order buffer: " << s.ooo_.size() << "\n";
-				handler.data(ts, it->second, d);
-				s.ooo_.erase(it);
-				it = s.ooo_.find(s.seqnr);
+				if (v == verdict::keep) v = handler.data(ts, b, d);
+			});
+			if (v == verdict::ignore) {
+				s.ignored = true;
+				s.ooo_.clear();
+			}
+			else if (v == verdict::drop) {
+				dropped_ = true;
+				for (auto& side : state_) side.ooo_.clear();
 			}
 		}
 	}
 
+	// the index of the packet that opened this stream
+	std::uint64_t flow_id;
+
+	// the timestamp (in seconds) of the last packet on this stream
+	std::int64_t last_seen = 0;
+
 private:
 
 	utp_stream_key key;
@@ -130,6 +184,8 @@ private:
 	// That's the outgoing direction. The SYN+ACK is then incoming.
 	array<utp_side_state, 2, dir_t> state_;
 
+	bool dropped_ = false;
+
 	Handler handler;
 };
 